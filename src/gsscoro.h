@@ -0,0 +1,279 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _GSS_CORO_
+#define _GSS_CORO_
+
+#if __cplusplus < 202002L || ! __has_include(<coroutine>)
+#error "gsscoro.h requires C++20 coroutines, configure with -DGSSLAYER_COROUTINES=ON"
+#endif
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <exception>
+#include <coroutine>
+
+#include "gsslayer.h"
+
+namespace Gss
+{
+    template<typename T>
+    class Task;
+
+    /// TaskPromiseBase: continuation and exception of a Task coroutine
+    struct TaskPromiseBase
+    {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+        /// set by the first of the finished task and its suspended awaiter, the second one resumes the awaiter
+        std::atomic<bool> ready{ false };
+
+        /// a task finished inside await_suspend returns to its awaiter without resume,
+        /// so loops over synchronous tasks keep a flat stack without relying on tail calls
+        struct FinalAwaiter
+        {
+            bool                await_ready(void) const noexcept { return false; }
+            void                await_resume(void) const noexcept {}
+
+            template<typename Promise>
+            void                await_suspend(std::coroutine_handle<Promise> handle) const noexcept
+            {
+                auto & promise = handle.promise();
+
+                if(promise.ready.exchange(true, std::memory_order_acq_rel) && promise.continuation)
+                    promise.continuation.resume();
+            }
+        };
+
+        std::suspend_always     initial_suspend(void) const noexcept { return {}; }
+        FinalAwaiter            final_suspend(void) const noexcept { return {}; }
+        void                    unhandled_exception(void) noexcept { exception = std::current_exception(); }
+
+        void                    rethrow(void) const
+        {
+            if(exception)
+                std::rethrow_exception(exception);
+        }
+    };
+
+    template<typename T>
+    struct TaskPromise : TaskPromiseBase
+    {
+        std::optional<T> value;
+
+        Task<T>                 get_return_object(void);
+        void                    return_value(T val) { value = std::move(val); }
+        T                       result(void) { rethrow(); return std::move(*value); }
+    };
+
+    template<>
+    struct TaskPromise<void> : TaskPromiseBase
+    {
+        Task<void>              get_return_object(void);
+        void                    return_void(void) {}
+        void                    result(void) { rethrow(); }
+    };
+
+    /// Task: lazy coroutine, runs on co_await or start() and resumes its awaiter when finished
+    template<typename T = void>
+    class Task
+    {
+    public:
+        using promise_type = TaskPromise<T>;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+    private:
+        handle_type handle;
+
+    public:
+        explicit Task(handle_type h) : handle(h) {}
+        ~Task() { if(handle) handle.destroy(); }
+
+        Task(const Task &) = delete;
+        Task & operator= (const Task &) = delete;
+
+        Task(Task && t) noexcept : handle(std::exchange(t.handle, nullptr)) {}
+        Task & operator= (Task && t) noexcept
+        {
+            if(this != & t)
+            {
+                if(handle)
+                    handle.destroy();
+                handle = std::exchange(t.handle, nullptr);
+            }
+            return *this;
+        }
+
+        bool                    await_ready(void) const noexcept { return ! handle || handle.done(); }
+        bool                    await_suspend(std::coroutine_handle<> awaiter) noexcept
+        {
+            handle.promise().continuation = awaiter;
+            handle.resume();
+            // false: the task is finished already, continue the awaiter without suspension
+            return ! handle.promise().ready.exchange(true, std::memory_order_acq_rel);
+        }
+        T                       await_resume(void) { return handle.promise().result(); }
+
+        /// run a top-level task until its first suspension, the event loop resumes it afterwards
+        void                    start(void) { if(handle && ! handle.done()) handle.resume(); }
+        bool                    done(void) const { return ! handle || handle.done(); }
+        /// the co_return value of a finished task, rethrow its exception
+        T                       result(void) { return handle.promise().result(); }
+    };
+
+    template<typename T>
+    Task<T> TaskPromise<T>::get_return_object(void)
+    {
+        return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+    }
+
+    inline Task<void> TaskPromise<void>::get_return_object(void)
+    {
+        return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+    }
+
+    /// AsyncContext: ClientContext or ServiceContext over an awaitable transport
+    /// buffers passed by pointer or reference must stay valid until the returned task is finished;
+    /// in concurrent mode the caller keeps one pending send and one pending receive task per context
+    template<typename BaseContext>
+    class AsyncContext : public BaseContext
+    {
+    public:
+        AsyncContext() = default;
+
+        /// awaitable transport adapter, suspend while the socket is not ready
+        virtual Task<std::vector<uint8_t>> asyncRecvToken(void) = 0;
+        virtual Task<void>      asyncSendToken(const void*, size_t) = 0;
+
+        /// one token per message, fail in frame mode: the fragments are sent by the blocking sendMessage only
+        Task<Result> asyncSendMessage(const void* buf, size_t len, bool encrypt = true)
+        {
+            if(this->frameSize())
+                co_return this->failure(__FUNCTION__, "frame mode", GSS_S_UNAVAILABLE, 0);
+
+            Buffer out;
+
+            if(auto res = this->wrap(buf, len, out, encrypt); ! res)
+                co_return res;
+
+            co_await asyncSendToken(out.data(), out.size());
+            co_return Result();
+        }
+
+        /// one token per message, fail in frame mode; out is empty on error
+        Task<Result> asyncRecvMessage(std::vector<uint8_t> & out)
+        {
+            out.clear();
+
+            if(this->frameSize())
+                co_return this->failure(__FUNCTION__, "frame mode", GSS_S_UNAVAILABLE, 0);
+
+            auto buf = co_await asyncRecvToken();
+            Buffer msg;
+
+            if(auto res = this->unwrap(buf.data(), buf.size(), msg); ! res)
+                co_return res;
+
+            out.assign(msg.data(), msg.data() + msg.size());
+            co_return Result();
+        }
+
+        Task<Result> asyncSendMIC(const void* msg, size_t msgsz)
+        {
+            Buffer out;
+
+            if(auto res = this->getMIC(msg, msgsz, out); ! res)
+                co_return res;
+
+            co_await asyncSendToken(out.data(), out.size());
+            co_return Result();
+        }
+
+        Task<Result> asyncRecvMIC(const void* msg, size_t msgsz)
+        {
+            auto buf = co_await asyncRecvToken();
+            co_return this->verifyMIC(msg, msgsz, buf.data(), buf.size());
+        }
+    };
+
+    /// AsyncServiceContext
+    class AsyncServiceContext : public AsyncContext<ServiceContext>
+    {
+    public:
+        AsyncServiceContext() = default;
+
+        Task<Result> asyncAcceptClient(void)
+        {
+            if(! creds)
+                co_return Result("credential", GSS_S_NO_CRED, 0);
+
+            resetContext();
+
+            std::vector<uint8_t> out;
+            auto status = HandshakeStatus::Continue;
+
+            while(status == HandshakeStatus::Continue)
+            {
+                // recv token
+                auto buf = co_await asyncRecvToken();
+                status = acceptStep(buf.data(), buf.size(), out);
+
+                if(out.size())
+                    co_await asyncSendToken(out.data(), out.size());
+            }
+
+            co_return handshake_result;
+        }
+    };
+
+    /// AsyncClientContext
+    class AsyncClientContext : public AsyncContext<ClientContext>
+    {
+    public:
+        AsyncClientContext() = default;
+
+        /// the name is copied into the coroutine frame
+        Task<Result> asyncInitConnect(std::string name, NameType type, int flags = GSS_C_MUTUAL_FLAG | GSS_C_REPLAY_FLAG)
+        {
+            std::vector<uint8_t> out;
+            auto status = initStart(name, type, out, flags);
+
+            while(true)
+            {
+                if(out.size())
+                    co_await asyncSendToken(out.data(), out.size());
+
+                if(status != HandshakeStatus::Continue)
+                    break;
+
+                auto buf = co_await asyncRecvToken();
+                status = initStep(buf.data(), buf.size(), out);
+            }
+
+            co_return handshake_result;
+        }
+    };
+}
+
+#endif
@@ -19,33 +19,298 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
-#include <sstream>
+#include <cstring>
+#include <algorithm>
 #include <iostream>
+#include <shared_mutex>
 
 #include "gsslayer.h"
 
 namespace Gss
 {
-    std::string error2str(OM_uint32 code1, OM_uint32 code2)
+    void NameRelease::operator()(gss_name_t name) const
     {
-        OM_uint32 ctx, stat;
-        gss_buffer_desc msg1, msg2;
+        OM_uint32 stat;
+        gss_release_name(& stat, & name);
+    }
+
+    void CredentialRelease::operator()(gss_cred_id_t cred) const
+    {
+        OM_uint32 stat;
+        gss_release_cred(& stat, & cred);
+    }
+
+    void SecContextRelease::operator()(gss_ctx_id_t ctx) const
+    {
+        OM_uint32 stat;
+        gss_delete_sec_context(& stat, & ctx, GSS_C_NO_BUFFER);
+    }
+
+    void OidSetRelease::operator()(gss_OID_set set) const
+    {
+        OM_uint32 stat;
+        gss_release_oid_set(& stat, & set);
+    }
+
+    namespace
+    {
+        uint32_t readIntBE32(const uint8_t* ptr)
+        {
+            return (uint32_t(ptr[0]) << 24) | (uint32_t(ptr[1]) << 16) | (uint32_t(ptr[2]) << 8) | uint32_t(ptr[3]);
+        }
+
+        void writeIntBE32(uint8_t* ptr, uint32_t val)
+        {
+            ptr[0] = val >> 24;
+            ptr[1] = val >> 16;
+            ptr[2] = val >> 8;
+            ptr[3] = val;
+        }
+
+        // chunk header of the streams and the frame mode fragments: [seq BE32][last flag]
+        const size_t streamHeaderSize = 5;
+
+        // Kerberos 5 mechanism, 1.2.840.113554.1.2.2
+        const gss_OID_desc krb5MechOid{ 9, (void*) "\x2a\x86\x48\x86\xf7\x12\x01\x02\x02" };
+        // SPNEGO pseudo mechanism, 1.3.6.1.5.5.2
+        const gss_OID_desc spnegoMechOid{ 6, (void*) "\x2b\x06\x01\x05\x05\x02" };
+
+        // the GSSAPI prototypes take non-const descriptors but never write them
+        const gss_OID_set_desc krb5MechSet{ 1, const_cast<gss_OID>(& krb5MechOid) };
+        const gss_OID_set_desc spnegoMechSet{ 1, const_cast<gss_OID>(& spnegoMechOid) };
+
+        // desired mechanisms of gss_acquire_cred
+        gss_OID_set mechanismSet(const Mechanism & mech)
+        {
+            switch(mech)
+            {
+                case Mechanism::Krb5:   return const_cast<gss_OID_set>(& krb5MechSet);
+                case Mechanism::Spnego: return const_cast<gss_OID_set>(& spnegoMechSet);
+                default: break;
+            }
+
+            return GSS_C_NO_OID_SET;
+        }
+    }
+
+    // Buffer
+    Buffer & Buffer::operator= (Buffer && other) noexcept
+    {
+        if(this != & other)
+        {
+            reset();
+            buf = other.buf;
+            other.buf = { 0, nullptr };
+        }
+
+        return *this;
+    }
+
+    void Buffer::reset(void)
+    {
+        if(buf.value)
+        {
+            OM_uint32 stat;
+            gss_release_buffer(& stat, & buf);
+        }
+
+        buf = { 0, nullptr };
+    }
+
+    // error messages
+    namespace
+    {
+        const size_t errorCacheLimit = 1024;
+
+        /// append all messages of the message_context chain
+        void displayStatus(std::string & res, OM_uint32 code, int type, const gss_OID & mech)
+        {
+            OM_uint32 ctx = 0;
+            OM_uint32 stat;
+            auto start = res.size();
+
+            do
+            {
+                Buffer msg;
+                auto ret = gss_display_status(& stat, code, type, mech, & ctx, msg.ptr());
+
+                if(GSS_ERROR(ret))
+                    break;
+
+                if(res.size() > start)
+                    res.append("; ");
+
+                res.append((const char*) msg.data(), msg.size());
+            }
+            while(ctx != 0);
+        }
+
+        std::string displayError(OM_uint32 code1, OM_uint32 code2, const gss_OID & mech)
+        {
+            std::string res;
+
+            displayStatus(res, code1, GSS_C_GSS_CODE, mech);
+            res.append(", (");
+            displayStatus(res, code2, GSS_C_MECH_CODE, mech);
+            res.append(")");
+
+            return res;
+        }
+
+        /// ErrorCache: formatted messages by (major, minor, mech), the entries are never removed
+        class ErrorCache
+        {
+            typedef std::tuple<OM_uint32, OM_uint32, std::string> Key;
+
+            std::map<Key, std::string, std::less<>> entries;
+            std::shared_mutex lock;
+
+        public:
+            std::string_view get(OM_uint32 code1, OM_uint32 code2, const gss_OID & mech)
+            {
+                std::string_view oid = mech ? std::string_view((const char*) mech->elements, mech->length) : std::string_view();
+                auto key = std::make_tuple(code1, code2, oid);
+
+                {
+                    const std::shared_lock guard{ lock };
+                    auto it = entries.find(key);
+
+                    if(it != entries.end())
+                        return it->second;
+                }
+
+                // cold path, outside the lock
+                auto msg = displayError(code1, code2, mech);
+
+                const std::scoped_lock guard{ lock };
+                auto it = entries.find(key);
+
+                if(it != entries.end())
+                    return it->second;
+
+                if(entries.size() < errorCacheLimit)
+                    return entries.emplace(std::make_tuple(code1, code2, std::string(oid)), std::move(msg)).first->second;
+
+                // cache is full: valid until the next call on this thread
+                thread_local std::string last;
+                last = std::move(msg);
+
+                return last;
+            }
+        };
+    }
+
+    std::string_view errorMessage(OM_uint32 code1, OM_uint32 code2, const gss_OID & mech)
+    {
+        // never destroyed: the ErrorLog thread formats the last records during exit
+        static ErrorCache* cache = new ErrorCache;
+        return cache->get(code1, code2, mech);
+    }
+
+    std::string error2str(OM_uint32 code1, OM_uint32 code2, const gss_OID & mech)
+    {
+        return std::string(errorMessage(code1, code2, mech));
+    }
+
+    // ErrorLog
+    ErrorLog::ErrorLog() : writer([](std::string_view line){ std::cerr << line << std::endl; })
+    {
+    }
+
+    ErrorLog::~ErrorLog()
+    {
+        {
+            const std::scoped_lock guard{ lock };
+            shutdown = true;
+        }
+
+        wake.notify_one();
+
+        if(worker.joinable())
+            worker.join();
+    }
+
+    ErrorLog & ErrorLog::instance(void)
+    {
+        static ErrorLog log;
+        return log;
+    }
 
-        ctx = 0;
-        gss_display_status(& stat, code1, GSS_C_GSS_CODE, GSS_C_NULL_OID, & ctx, & msg1);
-        ctx = 0;
-        gss_display_status(& stat, code2, GSS_C_MECH_CODE, GSS_C_NULL_OID, & ctx, & msg2);
+    void ErrorLog::push(const char* func, const char* subfunc, OM_uint32 code1, OM_uint32 code2, const gss_OID & mech)
+    {
+        {
+            const std::scoped_lock guard{ lock };
+
+            if(queue.size() >= limit || shutdown)
+            {
+                lost++;
+                return;
+            }
+
+            queue.push_back(Record{ func, subfunc, code1, code2, mech });
+
+            // started with the first record
+            if(! worker.joinable())
+                worker = std::thread([this]{ run(); });
+        }
+
+        wake.notify_one();
+    }
+
+    void ErrorLog::run(void)
+    {
+        std::vector<Record> records;
+        std::string line;
+        std::unique_lock<std::mutex> guard{ lock };
+
+        while(true)
+        {
+            wake.wait(guard, [this]{ return shutdown || ! queue.empty(); });
+
+            // drain the queue before exit
+            if(queue.empty())
+                break;
+
+            records.swap(queue);
+            writing = records.size();
+            auto out = writer;
+            guard.unlock();
 
-        std::ostringstream os;
-        os << (const char*) msg1.value << ", (" << (const char*) msg2.value << ")";
+            for(auto & rec : records)
+            {
+                line.assign(rec.func ? rec.func : "").append(": ").append(rec.subfunc ? rec.subfunc : "").append(" failed, error: ");
+                line.append(errorMessage(rec.code1, rec.code2, rec.mech));
+                out(line);
+            }
+
+            records.clear();
+            guard.lock();
+            writing = 0;
+            done.notify_all();
+        }
+    }
+
+    void ErrorLog::flush(void)
+    {
+        std::unique_lock<std::mutex> guard{ lock };
+
+        if(worker.joinable())
+            done.wait(guard, [this]{ return queue.empty() && writing == 0; });
+    }
 
-        gss_release_buffer(& stat, & msg1);
-        gss_release_buffer(& stat, & msg2);
+    void ErrorLog::setWriter(std::function<void(std::string_view)> func)
+    {
+        const std::scoped_lock guard{ lock };
+        writer = std::move(func);
+    }
 
-        return os.str();
+    void ErrorLog::setLimit(size_t num)
+    {
+        const std::scoped_lock guard{ lock };
+        limit = num;
     }
 
-    gss_name_t importName(std::string_view name, const NameType & type, ErrorCodes* err)
+    Name importName(std::string_view name, const NameType & type, ErrorCodes* err)
     {
         OM_uint32 stat;
         gss_OID oid;
@@ -63,9 +328,11 @@ namespace Gss
         }
  
         gss_buffer_desc buf{ name.size(), (void*) name.data() };
-        gss_name_t res = nullptr;
+        Name res;
 
-        auto ret = gss_import_name(& stat, & buf, oid, & res);
+        MetricTimer timer(MetricOp::ImportName);
+        auto ret = gss_import_name(& stat, & buf, oid, res.ptr());
+        timer.done(ret, name.size());
 
         if(ret == GSS_S_COMPLETE)
             return res;
@@ -77,20 +344,19 @@ namespace Gss
             err->code2 = stat;
         }
 
-        gss_release_name(& stat, & res);
-        return nullptr;
+        return Name();
     }
 
     std::string exportName(const gss_name_t & name, ErrorCodes* err)
     {
         OM_uint32 stat;
-        gss_buffer_desc buf;
+        Buffer buf;
         std::string res;
 
-        auto ret = gss_display_name(& stat, name, & buf, nullptr);
+        auto ret = gss_display_name(& stat, name, buf.ptr(), nullptr);
 
         if(ret == GSS_S_COMPLETE)
-            res.assign((char*) buf.value, (char*) buf.value + buf.length);
+            res.assign((const char*) buf.data(), buf.size());
         else
         if(err)
         {
@@ -99,345 +365,1618 @@ namespace Gss
             err->code2 = stat;
         }
 
-        gss_release_buffer(& stat, & buf);
         return res;
     }
 
     std::string exportOID(const gss_OID & oid, ErrorCodes* err)
     {
         OM_uint32 stat;
-        gss_buffer_desc buf;
+        Buffer buf;
 
-        auto ret = gss_oid_to_str(& stat, oid, & buf);
+        auto ret = gss_oid_to_str(& stat, oid, buf.ptr());
         std::string res;
 
         if(ret == GSS_S_COMPLETE)
-            res.assign((char*) buf.value, (char*) buf.value + buf.length);
+            res.assign((const char*) buf.data(), buf.size());
         else
         if(err)
         {
-            err->func = "gss_display_name";
+            err->func = "gss_oid_to_str";
             err->code1 = ret;
             err->code2 = stat;
         }
 
-        gss_release_buffer(& stat, & buf);
         return res;
     }
 
-    const char* flagName(const ContextFlag & flag)
+    gss_OID mechanismOid(const Mechanism & mech)
     {
-        switch(flag)
+        switch(mech)
         {
-            case ContextFlag::Delegate: return "delegate";
-            case ContextFlag::Mutual:   return "mutual";
-            case ContextFlag::Replay:   return "replay";
-            case ContextFlag::Sequence: return "sequence";
-            case ContextFlag::Confidential: return "confidential";
-            case ContextFlag::Integrity: return "integrity";
-            case ContextFlag::Anonymous: return "anonymous";
-            case ContextFlag::Protection: return "protection";
-            case ContextFlag::Transfer: return"transfer";
+            case Mechanism::Krb5:   return const_cast<gss_OID>(& krb5MechOid);
+            case Mechanism::Spnego: return const_cast<gss_OID>(& spnegoMechOid);
             default: break;
         }
 
-        return "unknown";
+        return GSS_C_NO_OID;
     }
 
-    std::list<ContextFlag> exportFlags(int flags)
+    // Oid
+    size_t Oid::hash(void) const
     {
-        auto all = { ContextFlag::Delegate, ContextFlag::Mutual, ContextFlag::Replay, ContextFlag::Sequence, ContextFlag::Confidential,
-                ContextFlag::Integrity, ContextFlag::Anonymous, ContextFlag::Protection, ContextFlag::Transfer };
-
-        std::list<ContextFlag> res;
+        uint64_t res = 0xcbf29ce484222325ull;
 
-        for(auto & v : all)
-            if(flags & v) res.push_front(v);
+        for(auto ptr = data(), end = ptr + size(); ptr != end; ++ptr)
+            res = (res ^ *ptr) * 0x100000001b3ull;
 
         return res;
     }
 
-    // Context
-    Context::~Context()
+    bool Oid::operator== (const Oid & v) const
     {
-        if(creds)
-        {
-            OM_uint32 stat = 0;
-            gss_release_cred(& stat, & creds);
-        }
+        return oid == v.oid || (size() == v.size() && 0 == std::memcmp(data(), v.data(), size()));
+    }
 
-        if(context_handle)
-        {
-            OM_uint32 stat = 0;
-            gss_delete_sec_context(& stat, & context_handle, GSS_C_NO_BUFFER);
-        }
+    std::ostream & operator<< (std::ostream & os, const Oid & oid)
+    {
+        os << "{ ";
 
-        if(src_name)
-        {
-            OM_uint32 stat = 0;
-            gss_release_name(& stat, & src_name);
-        }
+        uint64_t arc = 0;
+        bool first = true;
 
-        if(service_name)
+        for(auto ptr = oid.data(), end = ptr + oid.size(); ptr != end; ++ptr)
         {
-            OM_uint32 stat = 0;
-            gss_release_name(& stat, & service_name);
+            // base 128, the high bit continues the arc
+            arc = (arc << 7) | (*ptr & 0x7f);
+
+            if(*ptr & 0x80)
+                continue;
+
+            // the first subidentifier packs the two top arcs
+            if(first)
+            {
+                auto top = std::min<uint64_t>(arc / 40, 2);
+                os << top << " " << arc - top * 40 << " ";
+                first = false;
+            }
+            else
+            {
+                os << arc << " ";
+            }
+
+            arc = 0;
         }
+
+        return os << "}";
     }
 
-    void Context::error(const char* func, const char* subfunc, OM_uint32 code1, OM_uint32 code2) const
+    // ChannelBindings
+    ChannelBindings::ChannelBindings(const void* buf, size_t len) : data((const uint8_t*) buf, (const uint8_t*) buf + len)
     {
-        std::cerr << func << ": " << subfunc << " failed, error: " << error2str(code1, code2) << std::endl;
     }
 
-    std::vector<uint8_t> Context::recvMessage(void)
+    ChannelBindings ChannelBindings::tlsExporter(const void* buf, size_t len)
     {
-        OM_uint32 stat;
-        auto buf = recvToken();
-
-        gss_buffer_desc in_buf{ buf.size(), (void*) buf.data() };
-        gss_buffer_desc out_buf{ 0, nullptr, };
+        std::string_view prefix = "tls-exporter:";
+        ChannelBindings res;
 
-        auto ret = gss_unwrap(& stat, context_handle, & in_buf, & out_buf, nullptr, nullptr);
-        std::vector<uint8_t> res;
+        res.data.assign(prefix.begin(), prefix.end());
+        res.data.insert(res.data.end(), (const uint8_t*) buf, (const uint8_t*) buf + len);
 
-        if(ret == GSS_S_COMPLETE)
-        {
-            res.assign((uint8_t*) out_buf.value, (uint8_t*) out_buf.value + out_buf.length);
-        }
-        else
-        {
-            error(__FUNCTION__, "gss_unwrap", ret, stat);
-            res.clear();
-        }
-        
-        gss_release_buffer(& stat, & out_buf);
         return res;
     }
 
-    bool Context::sendMessage(const void* buf, size_t len, bool encrypt)
+    ChannelBindings ChannelBindings::tlsServerEndPoint(const void* buf, size_t len)
     {
-        OM_uint32 stat;
-
-        gss_buffer_desc in_buf{ len, (void*) buf };
-        gss_buffer_desc out_buf{ 0, nullptr, };
+        std::string_view prefix = "tls-server-end-point:";
+        ChannelBindings res;
 
-        auto ret = gss_wrap(& stat, context_handle, encrypt, GSS_C_QOP_DEFAULT, & in_buf, nullptr, & out_buf);
-        bool res = true;
+        res.data.assign(prefix.begin(), prefix.end());
+        res.data.insert(res.data.end(), (const uint8_t*) buf, (const uint8_t*) buf + len);
 
-        if(ret == GSS_S_COMPLETE)
-        {
-            sendToken(out_buf.value, out_buf.length);
-        }
-        else
-        {
-            error(__FUNCTION__, "gss_wrap", ret, stat);
-            res = false;
-        }
-        
-        gss_release_buffer(& stat, & out_buf);
         return res;
     }
 
-    bool Context::recvMIC(const void* msg, size_t msgsz)
+    gss_channel_bindings_t ChannelBindings::get(void) const
     {
-        OM_uint32 stat;
-
-        // recv token
-        auto buf = recvToken();
-
-        gss_buffer_desc in_buf{ msgsz, (void*) msg };
-        gss_buffer_desc out_buf{ buf.size(), (void*) buf.data() };
-
-        auto ret = gss_verify_mic(& stat, context_handle, & in_buf, & out_buf, nullptr);
+        if(data.empty())
+            return GSS_C_NO_CHANNEL_BINDINGS;
 
-        if(ret == GSS_S_COMPLETE)
-            return true;
+        // no addresses, only the application data
+        cb.initiator_addrtype = GSS_C_AF_UNSPEC;
+        cb.initiator_address = { 0, nullptr };
+        cb.acceptor_addrtype = GSS_C_AF_UNSPEC;
+        cb.acceptor_address = { 0, nullptr };
+        cb.application_data = { data.size(), (void*) data.data() };
 
-        error(__FUNCTION__, "gss_verify_mic", ret, stat);
-        return false;
+        return & cb;
     }
 
-    bool Context::sendMIC(const void* msg, size_t msgsz)
+    // CredentialCache
+    CredentialCache & CredentialCache::instance(void)
     {
-        OM_uint32 stat;
+        static CredentialCache cache;
+        return cache;
+    }
 
-        gss_buffer_desc in_buf{ msgsz, (void*) msg };
-        gss_buffer_desc out_buf{ 0, nullptr };
+    void CredentialCache::setRefreshMargin(const std::chrono::seconds & sec)
+    {
+        const std::scoped_lock guard{ lock };
+        margin = sec;
+    }
 
-        auto ret = gss_get_mic(& stat, context_handle, GSS_C_QOP_DEFAULT, & in_buf, & out_buf);
-        bool res = true;
+    void CredentialCache::clear(void)
+    {
+        const std::scoped_lock guard{ lock };
+        entries.clear();
+    }
 
-        if(ret == GSS_S_COMPLETE)
-        {
-            sendToken(out_buf.value, out_buf.length);
-        }
-        else
-        {
-            error(__FUNCTION__, "gss_get_mic", ret, stat);
-            res = false;
-        }
+    void CredentialCache::endRefresh(const std::tuple<std::string_view, NameType, int, Mechanism> & key)
+    {
+        const std::scoped_lock guard{ lock };
 
-        gss_release_buffer(& stat, & out_buf);
-        return res;
+        if(auto it = entries.find(key); it != entries.end())
+            it->second.refreshing = false;
     }
 
-    std::list<std::string> Context::mechNames(void) const
+    CredentialRef CredentialCache::acquire(std::string_view name, const NameType & type, const CredentialUsage & usage, ErrorCodes* err, const Mechanism & mech)
     {
-        std::list<std::string> res;
+        auto key = std::make_tuple(name, type, (int) usage, mech);
+        auto now = std::chrono::steady_clock::now();
+        CredentialRef prev;
 
-        OM_uint32 stat;
-        gss_OID_set mech_names;
-
-        auto ret = gss_inquire_names_for_mech(& stat, mech_types, & mech_names);
-        if(ret == GSS_S_COMPLETE)
         {
-            for(int it = 0; it < mech_names->count; ++it)
+            const std::scoped_lock guard{ lock };
+            auto it = entries.find(key);
+
+            if(it != entries.end())
             {
-                ErrorCodes err;
-                auto name = exportOID(& mech_names->elements[it], & err);
+                if(now < it->second.refresh)
+                    return it->second.cred;
 
-                if(name.empty())
+                if(now < it->second.expired)
                 {
-                    error(__FUNCTION__, err.func, err.code1, err.code2);
-                }
-                else
-                {
-                    res.push_front(name);
+                    // refresh in progress by another caller
+                    if(it->second.refreshing)
+                        return it->second.cred;
+
+                    it->second.refreshing = true;
+                    prev = it->second.cred;
                 }
             }
         }
-        else
-        {
-            error(__FUNCTION__, "gss_inquire_names_for_mech", ret, stat);
-        }
-
-        gss_release_oid_set(& stat, & mech_names);
-        return res;
-    }
 
-    bool Context::acquireCredential(std::string_view name, const NameType & type, const CredentialUsage & usage)
-    {
+        // cold acquire, outside the lock
         OM_uint32 stat;
-
-        if(service_name)
-            gss_release_name(& stat, & service_name);
-
-        ErrorCodes err;
-        service_name = importName(name, type, &err);
+        auto service_name = importName(name, type, err);
 
         if(! service_name)
         {
-            error(__FUNCTION__, err.func, err.code1, err.code2);
-            return false;
+            endRefresh(key);
+            return prev;
         }
 
-        if(creds)
-            gss_release_cred(& stat, & creds);
+        Credential cred;
+        OM_uint32 lifetime = 0;
 
-        auto ret = gss_acquire_cred(& stat, service_name, 0, GSS_C_NULL_OID_SET, usage, & creds, nullptr, nullptr);
+        MetricTimer timer(MetricOp::AcquireCred);
+        auto ret = gss_acquire_cred(& stat, service_name.get(), 0, mechanismSet(mech), usage, cred.ptr(), nullptr, & lifetime);
+        timer.done(ret, 0);
 
-        if(ret == GSS_S_COMPLETE)
-            return true;
+        if(ret != GSS_S_COMPLETE)
+        {
+            if(err)
+            {
+                err->func = "gss_acquire_cred";
+                err->code1 = ret;
+                err->code2 = stat;
+            }
 
-        if(ret == GSS_S_NO_CRED)
-            return false;
+            // the previous credential is still valid, the next caller tries again
+            endRefresh(key);
+            return prev;
+        }
+
+        const std::scoped_lock guard{ lock };
+        Entry entry{ CredentialRef(cred.release(), CredentialRelease()), std::chrono::steady_clock::time_point::max(), std::chrono::steady_clock::time_point::max() };
+
+        if(lifetime != GSS_C_INDEFINITE)
+        {
+            std::chrono::seconds sec{ lifetime };
+            entry.expired = now + sec;
+            entry.refresh = entry.expired - std::min(margin, sec / 2);
+        }
 
-        error(__FUNCTION__, "gss_acquire_cred", ret, stat);
-        return false;
+        auto res = entry.cred;
+        entries.insert_or_assign(std::make_tuple(std::string(name), type, (int) usage, mech), std::move(entry));
+
+        return res;
     }
 
-    // ServiceContext
-    bool ServiceContext::acceptClient(void)
+    // MechanismCache
+    MechanismCache::MechanismCache()
     {
-        if(! creds)
-            return false;
-
         OM_uint32 stat;
-        OM_uint32 ret = GSS_S_CONTINUE_NEEDED;
+        OidSet installed;
+        auto ret = gss_indicate_mechs(& stat, installed.ptr());
 
-        if(src_name)
-            gss_release_name(& stat, & src_name);
+        if(ret != GSS_S_COMPLETE)
+        {
+            ErrorLog::instance().push(__FUNCTION__, "gss_indicate_mechs", ret, stat, GSS_C_NO_OID);
+            return;
+        }
 
-        if(context_handle)
-            gss_delete_sec_context(& stat, & context_handle, GSS_C_NO_BUFFER);
+        infos.resize(installed.get()->count);
 
-        while(ret == GSS_S_CONTINUE_NEEDED)
+        for(size_t it = 0; it < infos.size(); ++it)
         {
-            // recv token
-            auto buf = recvToken();
+            auto & info = infos[it];
+            info.oid = & installed.get()->elements[it];
 
-            gss_buffer_desc recv_tok{ buf.size(), (void*) buf.data() };
-            gss_buffer_desc send_tok{ 0, nullptr };
+            OidSet names;
+            ret = gss_inquire_names_for_mech(& stat, info.oid.get(), names.ptr());
 
-            ret = gss_accept_sec_context(& stat, & context_handle, creds ? creds : GSS_C_NO_CREDENTIAL, & recv_tok, GSS_C_NO_CHANNEL_BINDINGS,
-                                     & src_name, & mech_types, & send_tok, & support_flags, & time_rec, nullptr);
+            if(ret == GSS_S_COMPLETE)
+            {
+                for(size_t pos = 0; pos < names.get()->count; ++pos)
+                    info.nameTypes.emplace_back(& names.get()->elements[pos]);
 
-            if(0 < send_tok.length)
+                sets.emplace_back(std::move(names));
+            }
+            else
             {
-                sendToken(send_tok.value, send_tok.length);
-                gss_release_buffer(& stat, & send_tok);
+                ErrorLog::instance().push(__FUNCTION__, "gss_inquire_names_for_mech", ret, stat, info.oid.get());
             }
-        }
 
-        if(ret == GSS_S_COMPLETE)
-            return true;
+            // optional RFC 5587 attributes, not every mechanism provides them
+            OidSet attrs;
 
-        error(__FUNCTION__, "gss_accept_sec_context", ret, stat);
-        return false;
+            if(GSS_S_COMPLETE == gss_inquire_attrs_for_mech(& stat, info.oid.get(), attrs.ptr(), nullptr) && attrs)
+            {
+                for(size_t pos = 0; pos < attrs.get()->count; ++pos)
+                {
+                    Buffer name, shortDesc, longDesc;
+
+                    if(GSS_S_COMPLETE == gss_display_mech_attr(& stat, & attrs.get()->elements[pos], name.ptr(), shortDesc.ptr(), longDesc.ptr()))
+                        info.attributes.emplace_back((const char*) name.data(), name.size());
+                }
+            }
+        }
+
+        sets.emplace_back(std::move(installed));
     }
 
-    // ClientContext
-    bool ClientContext::initConnect(std::string_view name, const NameType & type, int flags)
+    const MechanismCache & MechanismCache::instance(void)
     {
-        OM_uint32 stat;
+        static MechanismCache cache;
+        return cache;
+    }
 
-        if(src_name)
-            gss_release_name(& stat, & src_name);
+    const MechanismInfo* MechanismCache::find(const Oid & oid) const
+    {
+        if(! oid)
+            return nullptr;
 
-        ErrorCodes err;
-        src_name = importName(name, type, &err);
+        auto it = std::find_if(infos.begin(), infos.end(), [&](auto & info){ return info.oid == oid; });
+        return it != infos.end() ? & *it : nullptr;
+    }
 
-        if(! src_name)
-        {
-            error(__FUNCTION__, err.func, err.code1, err.code2);
-            return false;
-        }
+    const MechanismInfo* MechanismCache::find(const Mechanism & mech) const
+    {
+        return find(mechanismOid(mech));
+    }
 
-        if(context_handle)
-            gss_delete_sec_context(& stat, & context_handle, GSS_C_NO_BUFFER);
+    // NameCache
+    NameCache & NameCache::instance(void)
+    {
+        static NameCache cache;
+        return cache;
+    }
 
-        gss_channel_bindings_t input_chan_bindings = nullptr; // no channel bindings
-        std::vector<uint8_t> buf;
+    NameId NameCache::intern(const gss_name_t & name, const gss_OID & mech, ErrorCodes* err)
+    {
+        OM_uint32 stat;
+        Buffer exported;
 
-        gss_buffer_desc recv_tok{ 0, nullptr };
-        gss_buffer_desc send_tok{ name.size(), (void*) name.data() };
+        // a mechanism name exports directly, others are canonicalized first
+        const char* func = "gss_export_name";
+        auto ret = gss_export_name(& stat, name, exported.ptr());
 
-        OM_uint32 ret = GSS_S_CONTINUE_NEEDED;
-        while(ret == GSS_S_CONTINUE_NEEDED)
+        if(ret == GSS_S_NAME_NOT_MN)
         {
-            ret = gss_init_sec_context(& stat, creds ? creds : GSS_C_NO_CREDENTIAL, & context_handle, src_name, GSS_C_NULL_OID, flags,
-                                    0, input_chan_bindings, & recv_tok, & mech_types, & send_tok, & support_flags, & time_rec);
+            Name canon;
+            func = "gss_canonicalize_name";
+            ret = gss_canonicalize_name(& stat, name, mech ? mech : const_cast<gss_OID>(& krb5MechOid), canon.ptr());
 
-            if(0 < send_tok.length)
+            if(ret == GSS_S_COMPLETE)
             {
-                sendToken(send_tok.value, send_tok.length);
-                if(send_tok.value != name.data())
-                    gss_release_buffer(& stat, & send_tok);
+                func = "gss_export_name";
+                ret = gss_export_name(& stat, canon.get(), exported.ptr());
             }
+        }
+
+        if(ret != GSS_S_COMPLETE)
+        {
+            if(err)
+            {
+                err->func = func;
+                err->code1 = ret;
+                err->code2 = stat;
+            }
+
+            return 0;
+        }
+
+        std::string_view key((const char*) exported.data(), exported.size());
+
+        {
+            const std::shared_lock guard{ lock };
+            auto it = ids.find(key);
+
+            if(it != ids.end())
+                return it->second;
+        }
+
+        // new principal, outside the lock
+        Buffer display;
+        gss_display_name(& stat, name, display.ptr(), nullptr);
+
+        const std::scoped_lock guard{ lock };
+        auto it = ids.find(key);
+
+        if(it != ids.end())
+            return it->second;
+
+        names.push_back(Entry{ std::string(key), std::string((const char*) display.data(), display.size()) });
+        NameId id = names.size();
+        ids.emplace(names.back().exported, id);
+
+        return id;
+    }
+
+    NameId NameCache::intern(std::string_view name, const NameType & type, const gss_OID & mech, ErrorCodes* err)
+    {
+        // the same string canonicalizes per mechanism, null is krb5 as in the gss_name_t form
+        const gss_OID_desc* oid = mech ? mech : & krb5MechOid;
+        auto key = std::make_tuple(name, type, std::string_view((const char*) oid->elements, oid->length));
+
+        {
+            const std::shared_lock guard{ lock };
+            auto it = imports.find(key);
+
+            if(it != imports.end())
+                return it->second;
+        }
+
+        auto imported = importName(name, type, err);
+
+        if(! imported)
+            return 0;
+
+        auto id = intern(imported.get(), mech, err);
+
+        if(id)
+        {
+            const std::scoped_lock guard{ lock };
+            imports.emplace(std::make_tuple(std::string(name), type, std::string(std::get<2>(key))), id);
+        }
+
+        return id;
+    }
+
+    std::string_view NameCache::displayName(NameId id) const
+    {
+        const std::shared_lock guard{ lock };
+        return 0 < id && id <= names.size() ? std::string_view(names[id - 1].display) : std::string_view();
+    }
+
+    std::string_view NameCache::exportedName(NameId id) const
+    {
+        const std::shared_lock guard{ lock };
+        return 0 < id && id <= names.size() ? std::string_view(names[id - 1].exported) : std::string_view();
+    }
+
+    size_t NameCache::size(void) const
+    {
+        const std::shared_lock guard{ lock };
+        return names.size();
+    }
+
+    // Context
+    void Context::resetContext(void)
+    {
+        src_name.reset();
+        src_name_id = 0;
+        context_handle.reset();
+        established = false;
+        expiry = std::chrono::steady_clock::time_point::max();
+        frame_limit[0] = frame_limit[1] = 0;
+
+        if(renewal)
+            renewal->fired = false;
+    }
+
+    void Context::setLifetime(OM_uint32 sec)
+    {
+        time_rec = sec;
+        expiry = sec == GSS_C_INDEFINITE ? std::chrono::steady_clock::time_point::max() :
+                    std::chrono::steady_clock::now() + std::chrono::seconds(sec);
+    }
+
+    std::chrono::seconds Context::lifetimeLeft(void) const
+    {
+        if(expiry == std::chrono::steady_clock::time_point::max())
+            return std::chrono::seconds::max();
+
+        auto left = std::chrono::duration_cast<std::chrono::seconds>(expiry - std::chrono::steady_clock::now());
+        return left.count() < 0 ? std::chrono::seconds(0) : left;
+    }
+
+    bool Context::expiresSoon(const std::chrono::seconds & margin) const
+    {
+        return expiry - margin <= std::chrono::steady_clock::now();
+    }
+
+    Result Context::refreshLifetime(void)
+    {
+        // checkExpiry() reads the deadline under either direction lock, always send then recv
+        auto sguard = sendLock();
+        auto rguard = recvLock();
+
+        OM_uint32 stat, sec = 0;
+        auto ret = gss_context_time(& stat, context_handle.get(), & sec);
+
+        if(ret == GSS_S_CONTEXT_EXPIRED)
+        {
+            time_rec = 0;
+            expiry = std::chrono::steady_clock::now();
+        }
+        else
+        if(ret == GSS_S_COMPLETE)
+        {
+            setLifetime(sec);
+            return Result();
+        }
+
+        return failure(__FUNCTION__, "gss_context_time", ret, stat);
+    }
+
+    void Context::setExpiryHandler(std::function<void(Context &)> func, const std::chrono::seconds & margin)
+    {
+        if(! func)
+        {
+            renewal.reset();
+            return;
+        }
+
+        if(! renewal)
+            renewal = std::make_unique<Renewal>();
+
+        renewal->handler = std::move(func);
+        renewal->margin = margin;
+        renewal->fired = false;
+    }
+
+    std::chrono::steady_clock::time_point Context::renewalTime(void) const
+    {
+        if(! renewal || renewal->fired || expiry == std::chrono::steady_clock::time_point::max())
+            return std::chrono::steady_clock::time_point::max();
+
+        return expiry - renewal->margin;
+    }
+
+    void Context::checkExpiry(void)
+    {
+        // one pointer test without a handler, one clock read with it
+        if(renewal && ! renewal->fired.load(std::memory_order_relaxed) &&
+            expiry - renewal->margin <= std::chrono::steady_clock::now() && ! renewal->fired.exchange(true))
+            renewal->handler(*this);
+    }
+
+    void Context::pollExpiry(void)
+    {
+        checkExpiry();
+    }
+
+    void Context::setConcurrentMode(bool f)
+    {
+        if(f && ! locks)
+            locks = std::make_unique<Locks>();
+        else
+        if(! f)
+            locks.reset();
+    }
+
+    std::unique_lock<std::mutex> Context::sendLock(void)
+    {
+        return locks ? std::unique_lock<std::mutex>(locks->send) : std::unique_lock<std::mutex>();
+    }
+
+    std::unique_lock<std::mutex> Context::recvLock(void)
+    {
+        return locks ? std::unique_lock<std::mutex>(locks->recv) : std::unique_lock<std::mutex>();
+    }
+
+    std::vector<uint8_t> Context::recvToken(void)
+    {
+        error(__FUNCTION__, "transport", GSS_S_UNAVAILABLE, 0);
+        return {};
+    }
+
+    void Context::sendToken(const void* buf, size_t len)
+    {
+        error(__FUNCTION__, "transport", GSS_S_UNAVAILABLE, 0);
+    }
+
+    bool Context::recvTokenInto(std::pmr::vector<uint8_t> & token)
+    {
+        // copies through a new vector, the reusing transports override it
+        auto buf = recvToken();
+
+        if(buf.empty())
+            return false;
+
+        token.assign(buf.begin(), buf.end());
+        return true;
+    }
+
+    void Context::setMemoryResource(std::pmr::memory_resource* res)
+    {
+        recv_token = std::make_unique<std::pmr::vector<uint8_t>>(res ? res : std::pmr::get_default_resource());
+    }
+
+    void Context::error(const char* func, const char* subfunc, OM_uint32 code1, OM_uint32 code2) const
+    {
+        ErrorLog::instance().push(func, subfunc, code1, code2, mech_types);
+    }
+
+    Result Context::failure(const char* func, const char* subfunc, OM_uint32 code1, OM_uint32 code2) const
+    {
+        error(func, subfunc, code1, code2);
+        return Result(subfunc ? subfunc : func, code1, code2);
+    }
+
+    Result Context::wrapBuffer(const void* buf, size_t len, Buffer & out, bool encrypt)
+    {
+        checkExpiry();
+        OM_uint32 stat;
+        gss_buffer_desc in_buf{ len, (void*) buf };
+
+        MetricTimer timer(MetricOp::Wrap, & stats);
+        auto ret = gss_wrap(& stat, context_handle.get(), encrypt, GSS_C_QOP_DEFAULT, & in_buf, nullptr, out.ptr());
+        timer.done(ret, len);
+
+        if(ret == GSS_S_COMPLETE)
+            return Result();
+
+        return failure(__FUNCTION__, "gss_wrap", ret, stat);
+    }
+
+    Result Context::unwrapBuffer(const void* buf, size_t len, Buffer & out)
+    {
+        checkExpiry();
+        OM_uint32 stat;
+        gss_buffer_desc in_buf{ len, (void*) buf };
+
+        MetricTimer timer(MetricOp::Unwrap, & stats);
+        auto ret = gss_unwrap(& stat, context_handle.get(), & in_buf, out.ptr(), nullptr, nullptr);
+        timer.done(ret, len);
+
+        if(ret == GSS_S_COMPLETE)
+            return Result();
+
+        return failure(__FUNCTION__, "gss_unwrap", ret, stat);
+    }
+
+    Result Context::micBuffer(const void* msg, size_t msgsz, Buffer & out)
+    {
+        checkExpiry();
+        OM_uint32 stat;
+        gss_buffer_desc in_buf{ msgsz, (void*) msg };
+
+        MetricTimer timer(MetricOp::GetMIC, & stats);
+        auto ret = gss_get_mic(& stat, context_handle.get(), GSS_C_QOP_DEFAULT, & in_buf, out.ptr());
+        timer.done(ret, msgsz);
+
+        if(ret == GSS_S_COMPLETE)
+            return Result();
+
+        return failure(__FUNCTION__, "gss_get_mic", ret, stat);
+    }
+
+    Result Context::checkMIC(const void* msg, size_t msgsz, const void* mic, size_t micsz)
+    {
+        checkExpiry();
+        OM_uint32 stat;
+
+        gss_buffer_desc in_buf{ msgsz, (void*) msg };
+        gss_buffer_desc mic_buf{ micsz, (void*) mic };
+
+        MetricTimer timer(MetricOp::VerifyMIC, & stats);
+        auto ret = gss_verify_mic(& stat, context_handle.get(), & in_buf, & mic_buf, nullptr);
+        timer.done(ret, msgsz);
+
+        if(ret == GSS_S_COMPLETE)
+            return Result();
+
+        return failure(__FUNCTION__, "gss_verify_mic", ret, stat);
+    }
+
+    Result Context::wrap(const void* buf, size_t len, Buffer & out, bool encrypt)
+    {
+        auto guard = sendLock();
+        return wrapBuffer(buf, len, out, encrypt);
+    }
+
+    Result Context::unwrap(const void* buf, size_t len, Buffer & out)
+    {
+        auto guard = recvLock();
+        return unwrapBuffer(buf, len, out);
+    }
+
+    Result Context::getMIC(const void* msg, size_t msgsz, Buffer & out)
+    {
+        auto guard = sendLock();
+        return micBuffer(msg, msgsz, out);
+    }
+
+    Result Context::verifyMIC(const void* msg, size_t msgsz, const void* mic, size_t micsz)
+    {
+        auto guard = recvLock();
+        return checkMIC(msg, msgsz, mic, micsz);
+    }
+
+    void Context::setFrameSize(size_t framesz, size_t maxmsg)
+    {
+        frame_size = framesz;
+        max_message = maxmsg;
+        frame_limit[0] = frame_limit[1] = 0;
+    }
+
+    size_t Context::frameLimit(bool encrypt)
+    {
+        // one gss_wrap_size_limit per frame size and context, not per message
+        if(! frame_limit[encrypt])
+            frame_limit[encrypt] = wrapSizeLimit(frame_size, encrypt);
+
+        return frame_limit[encrypt];
+    }
+
+    size_t Context::framePayload(bool encrypt)
+    {
+        auto guard = sendLock();
+
+        if(! frame_size || ! established)
+            return 0;
+
+        auto limit = frameLimit(encrypt);
+        return limit > streamHeaderSize ? limit - streamHeaderSize : 0;
+    }
+
+    Result Context::sendFragments(const void* buf, size_t len, bool encrypt)
+    {
+        auto limit = frameLimit(encrypt);
+
+        if(limit <= streamHeaderSize)
+            return failure(__FUNCTION__, "frame size", GSS_S_FAILURE, 0);
+
+        auto ptr = (const uint8_t*) buf;
+        uint32_t seq = 0;
+        Buffer out_buf;
+
+        // an empty message is one empty last fragment
+        do
+        {
+            auto part = std::min(len, limit - streamHeaderSize);
+
+            send_frame.resize(streamHeaderSize + part);
+            writeIntBE32(send_frame.data(), seq++);
+            send_frame[4] = part == len ? 1 : 0;
+            std::copy_n(ptr, part, send_frame.data() + streamHeaderSize);
+
+            if(auto res = wrapBuffer(send_frame.data(), send_frame.size(), out_buf, encrypt); ! res)
+                return res;
+
+            sendToken(out_buf.data(), out_buf.size());
+
+            ptr += part;
+            len -= part;
+        }
+        while(len);
+
+        return Result();
+    }
+
+    Result Context::checkFragment(const uint8_t* data, size_t len, uint32_t seq, bool & last) const
+    {
+        if(len < streamHeaderSize)
+            return failure(__FUNCTION__, "fragment", GSS_S_DEFECTIVE_TOKEN, 0);
+
+        if(readIntBE32(data) != seq)
+            return failure(__FUNCTION__, "fragment sequence", GSS_S_UNSEQ_TOKEN, 0);
+
+        last = data[4];
+        return Result();
+    }
+
+    std::vector<uint8_t> Context::recvMessage(void)
+    {
+        std::vector<uint8_t> res;
+
+        if(! recvMessage(res))
+            res.clear();
+
+        return res;
+    }
+
+    Result Context::recvMessage(std::vector<uint8_t> & out)
+    {
+        auto guard = recvLock();
+        Buffer out_buf;
+
+        if(! frame_size)
+        {
+            auto buf = recvToken();
+
+            if(auto res = unwrapBuffer(buf.data(), buf.size(), out_buf); ! res)
+                return res;
+
+            out.assign(out_buf.data(), out_buf.data() + out_buf.size());
+            return Result();
+        }
+
+        out.clear();
+
+        for(uint32_t seq = 0; ; ++seq)
+        {
+            auto buf = recvToken();
+            bool last = false;
+
+            if(auto res = unwrapBuffer(buf.data(), buf.size(), out_buf); ! res)
+                return res;
+
+            if(auto res = checkFragment(out_buf.data(), out_buf.size(), seq, last); ! res)
+                return res;
+
+            out.insert(out.end(), out_buf.data() + streamHeaderSize, out_buf.data() + out_buf.size());
+
+            if(out.size() > max_message)
+                return failure(__FUNCTION__, "message size", GSS_S_DEFECTIVE_TOKEN, 0);
+
+            if(last)
+                return Result();
+        }
+    }
+
+    Result Context::recvMessage(std::pmr::vector<uint8_t> & out)
+    {
+        auto guard = recvLock();
+
+        if(! recv_token)
+            recv_token = std::make_unique<std::pmr::vector<uint8_t>>();
+
+        auto & token = *recv_token;
+
+        uint8_t* data = nullptr;
+        size_t len = 0;
+
+        if(! frame_size)
+        {
+            if(! recvTokenInto(token))
+                return Result("transport", GSS_S_UNAVAILABLE, 0);
+
+            if(auto res = unwrapStream(token.data(), token.size(), data, len); ! res)
+                return res;
+
+            out.assign(data, data + len);
+            return Result();
+        }
+
+        out.clear();
+
+        for(uint32_t seq = 0; ; ++seq)
+        {
+            bool last = false;
+
+            if(! recvTokenInto(token))
+                return Result("transport", GSS_S_UNAVAILABLE, 0);
+
+            if(auto res = unwrapStream(token.data(), token.size(), data, len); ! res)
+                return res;
+
+            if(auto res = checkFragment(data, len, seq, last); ! res)
+                return res;
+
+            out.insert(out.end(), data + streamHeaderSize, data + len);
+
+            if(out.size() > max_message)
+                return failure(__FUNCTION__, "message size", GSS_S_DEFECTIVE_TOKEN, 0);
+
+            if(last)
+                return Result();
+        }
+    }
+
+    Result Context::sendMessage(const void* buf, size_t len, bool encrypt)
+    {
+        auto guard = sendLock();
+
+        if(frame_size)
+            return sendFragments(buf, len, encrypt);
+
+        Buffer out_buf;
+
+        if(auto res = wrapBuffer(buf, len, out_buf, encrypt); ! res)
+            return res;
+
+        sendToken(out_buf.data(), out_buf.size());
+        return Result();
+    }
+
+    Result Context::recvMIC(const void* msg, size_t msgsz)
+    {
+        auto guard = recvLock();
+
+        // recv token
+        auto buf = recvToken();
+        return checkMIC(msg, msgsz, buf.data(), buf.size());
+    }
+
+    Result Context::sendMIC(const void* msg, size_t msgsz)
+    {
+        auto guard = sendLock();
+        Buffer out_buf;
+
+        if(auto res = micBuffer(msg, msgsz, out_buf); ! res)
+            return res;
+
+        sendToken(out_buf.data(), out_buf.size());
+        return Result();
+    }
+
+    Result Context::signBatch(const BufferView* msgs, size_t count, std::vector<uint8_t> & frame)
+    {
+        checkExpiry();
+
+        OM_uint32 stat;
+        frame.resize(4);
+        writeIntBE32(frame.data(), count);
+
+        for(size_t it = 0; it < count; ++it)
+        {
+            gss_iov_buffer_desc iov[2];
+
+            iov[0].type = GSS_IOV_BUFFER_TYPE_DATA;
+            iov[0].buffer = { msgs[it].size, (void*) msgs[it].data };
+            iov[1].type = GSS_IOV_BUFFER_TYPE_MIC_TOKEN;
+            iov[1].buffer = { 0, nullptr };
+
+            auto ret = gss_get_mic_iov_length(& stat, context_handle.get(), GSS_C_QOP_DEFAULT, iov, 2);
+
+            if(ret != GSS_S_COMPLETE)
+            {
+                return failure(__FUNCTION__, "gss_get_mic_iov_length", ret, stat);
+            }
+
+            // mic size is fixed per context, reserve the whole frame once
+            if(it == 0)
+                frame.reserve(4 + count * (4 + iov[1].buffer.length));
+
+            auto pos = frame.size();
+            frame.resize(pos + 4 + iov[1].buffer.length);
+            iov[1].buffer.value = frame.data() + pos + 4;
+
+            MetricTimer timer(MetricOp::GetMIC, & stats);
+            ret = gss_get_mic_iov(& stat, context_handle.get(), GSS_C_QOP_DEFAULT, iov, 2);
+            timer.done(ret, msgs[it].size);
+
+            if(ret != GSS_S_COMPLETE)
+            {
+                return failure(__FUNCTION__, "gss_get_mic_iov", ret, stat);
+            }
+
+            writeIntBE32(frame.data() + pos, iov[1].buffer.length);
+            frame.resize(pos + 4 + iov[1].buffer.length);
+        }
+
+        return Result();
+    }
+
+    Result Context::verifyBatch(const BufferView* msgs, size_t count, const void* frame, size_t len, std::vector<bool>* verified)
+    {
+        checkExpiry();
+        auto ptr = (const uint8_t*) frame;
+        auto end = ptr + len;
+
+        if(len < 4 || readIntBE32(ptr) != count)
+        {
+            return failure(__FUNCTION__, "frame", GSS_S_DEFECTIVE_TOKEN, 0);
+        }
+
+        if(verified)
+            verified->assign(count, false);
+
+        ptr += 4;
+        Result res;
+
+        for(size_t it = 0; it < count; ++it)
+        {
+            size_t micsz = 4 <= end - ptr ? readIntBE32(ptr) : len;
+
+            if(end - ptr < 4 + micsz)
+            {
+                return failure(__FUNCTION__, "frame", GSS_S_DEFECTIVE_TOKEN, 0);
+            }
+
+            OM_uint32 stat;
+            gss_buffer_desc in_buf{ msgs[it].size, (void*) msgs[it].data };
+            gss_buffer_desc mic_buf{ micsz, (void*) (ptr + 4) };
+
+            MetricTimer timer(MetricOp::VerifyMIC, & stats);
+            auto ret = gss_verify_mic(& stat, context_handle.get(), & in_buf, & mic_buf, nullptr);
+            timer.done(ret, msgs[it].size);
+
+            if(ret == GSS_S_COMPLETE)
+            {
+                if(verified)
+                    (*verified)[it] = true;
+            }
+            else
+            {
+                res = failure(__FUNCTION__, "gss_verify_mic", ret, stat);
+            }
+
+            ptr += 4 + micsz;
+        }
+
+        return res;
+    }
+
+    Result Context::getMICBatch(const BufferView* msgs, size_t count, std::vector<uint8_t> & frame)
+    {
+        auto guard = sendLock();
+        return signBatch(msgs, count, frame);
+    }
+
+    Result Context::verifyMICBatch(const BufferView* msgs, size_t count, const void* frame, size_t len, std::vector<bool>* verified)
+    {
+        auto guard = recvLock();
+        return verifyBatch(msgs, count, frame, len, verified);
+    }
+
+    Result Context::recvMICBatch(const BufferView* msgs, size_t count, std::vector<bool>* verified)
+    {
+        auto guard = recvLock();
+
+        // recv token
+        auto buf = recvToken();
+        return verifyBatch(msgs, count, buf.data(), buf.size(), verified);
+    }
+
+    Result Context::sendMICBatch(const BufferView* msgs, size_t count)
+    {
+        auto guard = sendLock();
+
+        if(auto res = signBatch(msgs, count, mic_arena); ! res)
+            return res;
+
+        sendToken(mic_arena.data(), mic_arena.size());
+        return Result();
+    }
+
+    size_t Context::wrapSizeLimit(size_t len, bool encrypt) const
+    {
+        OM_uint32 stat;
+        OM_uint32 res = 0;
+
+        auto ret = gss_wrap_size_limit(& stat, context_handle.get(), encrypt, GSS_C_QOP_DEFAULT, std::min<size_t>(len, UINT32_MAX), & res);
+
+        if(ret == GSS_S_COMPLETE)
+            return res;
+
+        error(__FUNCTION__, "gss_wrap_size_limit", ret, stat);
+        return 0;
+    }
+
+    size_t Context::wrapOverhead(size_t len, bool encrypt) const
+    {
+        IovLength iov;
+        return wrapIovLength(len, iov, encrypt) ? iov.frameSize() - len : 0;
+    }
+
+    Result Context::wrapIovLength(size_t len, IovLength & res, bool encrypt) const
+    {
+        OM_uint32 stat;
+        gss_iov_buffer_desc iov[4];
+
+        iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+        iov[0].buffer = { 0, nullptr };
+        iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+        iov[1].buffer = { len, nullptr };
+        iov[2].type = GSS_IOV_BUFFER_TYPE_PADDING;
+        iov[2].buffer = { 0, nullptr };
+        iov[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+        iov[3].buffer = { 0, nullptr };
+
+        auto ret = gss_wrap_iov_length(& stat, context_handle.get(), encrypt, GSS_C_QOP_DEFAULT, nullptr, iov, 4);
+
+        if(ret == GSS_S_COMPLETE)
+        {
+            res.header = iov[0].buffer.length;
+            res.data = len;
+            res.padding = iov[2].buffer.length;
+            res.trailer = iov[3].buffer.length;
+            return Result();
+        }
+
+        return failure(__FUNCTION__, "gss_wrap_iov_length", ret, stat);
+    }
+
+    Result Context::wrapIov(void* frame, const IovLength & len, bool encrypt)
+    {
+        auto guard = sendLock();
+        checkExpiry();
+        OM_uint32 stat;
+        gss_iov_buffer_desc iov[4];
+        auto ptr = (uint8_t*) frame;
+
+        // caller-owned sections, the payload is already placed after the header
+        iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+        iov[0].buffer = { len.header, ptr };
+        iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+        iov[1].buffer = { len.data, ptr + len.header };
+        iov[2].type = GSS_IOV_BUFFER_TYPE_PADDING;
+        iov[2].buffer = { len.padding, ptr + len.header + len.data };
+        iov[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+        iov[3].buffer = { len.trailer, ptr + len.header + len.data + len.padding };
+
+        MetricTimer timer(MetricOp::Wrap, & stats);
+        auto ret = gss_wrap_iov(& stat, context_handle.get(), encrypt, GSS_C_QOP_DEFAULT, nullptr, iov, 4);
+        timer.done(ret, len.data);
+
+        if(ret == GSS_S_COMPLETE)
+            return Result();
+
+        return failure(__FUNCTION__, "gss_wrap_iov", ret, stat);
+    }
 
-            if(ret == GSS_S_CONTINUE_NEEDED)
+    Result Context::unwrapIov(void* frame, size_t len, uint8_t* & data, size_t & datasz)
+    {
+        auto guard = recvLock();
+        return unwrapStream(frame, len, data, datasz);
+    }
+
+    Result Context::unwrapStream(void* frame, size_t len, uint8_t* & data, size_t & datasz)
+    {
+        checkExpiry();
+        OM_uint32 stat;
+        gss_iov_buffer_desc iov[2];
+
+        // the mechanism decrypts in place and points the data section into the stream
+        iov[0].type = GSS_IOV_BUFFER_TYPE_STREAM;
+        iov[0].buffer = { len, frame };
+        iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+        iov[1].buffer = { 0, nullptr };
+
+        MetricTimer timer(MetricOp::Unwrap, & stats);
+        auto ret = gss_unwrap_iov(& stat, context_handle.get(), nullptr, nullptr, iov, 2);
+        timer.done(ret, len);
+
+        if(ret == GSS_S_COMPLETE)
+        {
+            data = (uint8_t*) iov[1].buffer.value;
+            datasz = iov[1].buffer.length;
+            return Result();
+        }
+
+        return failure(__FUNCTION__, "gss_unwrap_iov", ret, stat);
+    }
+
+    NameId Context::srcNameId(void)
+    {
+        if(! src_name_id && src_name)
+        {
+            ErrorCodes err;
+            src_name_id = NameCache::instance().intern(src_name.get(), mech_types, & err);
+
+            if(! src_name_id)
+                error(__FUNCTION__, err.func, err.code1, err.code2);
+        }
+
+        return src_name_id;
+    }
+
+    const std::vector<Oid> & Context::mechNames(void) const
+    {
+        static const std::vector<Oid> empty;
+        auto info = MechanismCache::instance().find(mech_types);
+
+        return info ? info->nameTypes : empty;
+    }
+
+    std::vector<uint8_t> Context::exportContext(void)
+    {
+        std::vector<uint8_t> res;
+
+        if(! exportContext(res))
+            res.clear();
+
+        return res;
+    }
+
+    Result Context::exportContext(std::vector<uint8_t> & out)
+    {
+        if(! established)
+            return Result("context", GSS_S_NO_CONTEXT, 0);
+
+        OM_uint32 stat;
+        Buffer buf;
+
+        MetricTimer timer(MetricOp::ExportContext);
+        auto ret = gss_export_sec_context(& stat, context_handle.ptr(), buf.ptr());
+        timer.done(ret, 0);
+
+        if(ret != GSS_S_COMPLETE)
+            return failure(__FUNCTION__, "gss_export_sec_context", ret, stat);
+
+        out.assign(buf.data(), buf.data() + buf.size());
+        resetContext();
+
+        return Result();
+    }
+
+    Result Context::importContext(const void* buf, size_t len)
+    {
+        OM_uint32 stat;
+        resetContext();
+
+        gss_buffer_desc in_buf{ len, (void*) buf };
+        MetricTimer timer(MetricOp::ImportContext);
+        auto ret = gss_import_sec_context(& stat, & in_buf, context_handle.ptr());
+        timer.done(ret, len);
+
+        if(ret != GSS_S_COMPLETE)
+        {
+            return failure(__FUNCTION__, "gss_import_sec_context", ret, stat);
+        }
+
+        Name init_name, accept_name;
+        int local = 0;
+        int open = 0;
+
+        ret = gss_inquire_context(& stat, context_handle.get(), init_name.ptr(), accept_name.ptr(), & time_rec,
+                                    & mech_types, & support_flags, & local, & open);
+
+        if(ret != GSS_S_COMPLETE)
+        {
+            context_handle.reset();
+            return failure(__FUNCTION__, "gss_inquire_context", ret, stat);
+        }
+
+        // initiator keeps the target name, acceptor keeps the client name
+        src_name = local ? std::move(accept_name) : std::move(init_name);
+        established = open;
+        setLifetime(time_rec);
+
+        return Result();
+    }
+
+    Result Context::acquireCredential(std::string_view name, const NameType & type, const CredentialUsage & usage, bool cached)
+    {
+        OM_uint32 stat;
+        ErrorCodes err;
+
+        if(cached)
+        {
+            creds = CredentialCache::instance().acquire(name, type, usage, & err, mech_select);
+
+            if(creds)
+                return Result();
+
+            if(! err.func)
+                return Result("gss_acquire_cred", GSS_S_NO_CRED, 0);
+
+            if(err.code1 != GSS_S_NO_CRED)
+                return failure(__FUNCTION__, err.func, err.code1, err.code2);
+
+            return Result(err.func, err.code1, err.code2);
+        }
+
+        service_name = importName(name, type, &err);
+
+        if(! service_name)
+        {
+            return failure(__FUNCTION__, err.func, err.code1, err.code2);
+        }
+
+        creds.reset();
+        Credential cred;
+
+        MetricTimer timer(MetricOp::AcquireCred);
+        auto ret = gss_acquire_cred(& stat, service_name.get(), 0, mechanismSet(mech_select), usage, cred.ptr(), nullptr, nullptr);
+        timer.done(ret, 0);
+
+        if(ret == GSS_S_COMPLETE)
+        {
+            creds.reset(cred.release(), CredentialRelease());
+            return Result();
+        }
+
+        // no keytab or ticket is not logged
+        if(ret == GSS_S_NO_CRED)
+            return Result("gss_acquire_cred", ret, stat);
+
+        return failure(__FUNCTION__, "gss_acquire_cred", ret, stat);
+    }
+
+    // StreamWriter
+
+    StreamWriter::StreamWriter(Context & c, size_t tokensz, bool enc) : ctx(c), encrypt(enc)
+    {
+        limit = ctx.wrapSizeLimit(tokensz, encrypt);
+
+        if(limit <= streamHeaderSize)
+        {
+            limit = 0;
+            return;
+        }
+
+        chunk.reserve(limit);
+        chunk.resize(streamHeaderSize);
+    }
+
+    Result StreamWriter::flush(bool last)
+    {
+        writeIntBE32(chunk.data(), seq++);
+        chunk[4] = last ? 1 : 0;
+
+        auto res = ctx.sendMessage(chunk.data(), chunk.size(), encrypt);
+        chunk.resize(streamHeaderSize);
+
+        if(last)
+            seq = 0;
+
+        return res;
+    }
+
+    Result StreamWriter::write(const void* buf, size_t len)
+    {
+        if(! isValid())
+            return Result("stream", GSS_S_FAILURE, 0);
+
+        auto ptr = (const uint8_t*) buf;
+
+        while(len)
+        {
+            // keep the last full chunk until finish or the next write
+            if(chunk.size() == limit)
+            {
+                if(auto res = flush(false); ! res)
+                    return res;
+            }
+
+            auto part = std::min(len, limit - chunk.size());
+            chunk.insert(chunk.end(), ptr, ptr + part);
+
+            ptr += part;
+            len -= part;
+        }
+
+        return Result();
+    }
+
+    Result StreamWriter::finish(void)
+    {
+        if(! isValid())
+            return Result("stream", GSS_S_FAILURE, 0);
+
+        return flush(true);
+    }
+
+    // StreamReader
+    Result StreamReader::read(std::vector<uint8_t> & buf)
+    {
+        if(finished)
+        {
+            finished = false;
+            seq = 0;
+        }
+
+        if(auto res = ctx.recvMessage(buf); ! res)
+            return res;
+
+        if(buf.size() < streamHeaderSize)
+        {
+            ctx.error(__FUNCTION__, "stream chunk", GSS_S_DEFECTIVE_TOKEN, 0);
+            return Result("stream chunk", GSS_S_DEFECTIVE_TOKEN, 0);
+        }
+
+        if(readIntBE32(buf.data()) != seq)
+        {
+            ctx.error(__FUNCTION__, "stream sequence", GSS_S_UNSEQ_TOKEN, 0);
+            return Result("stream sequence", GSS_S_UNSEQ_TOKEN, 0);
+        }
+
+        seq++;
+        finished = buf[4];
+
+        buf.erase(buf.begin(), buf.begin() + streamHeaderSize);
+        return Result();
+    }
+
+    // BatchWriter
+    const size_t batchHeaderSize = 4;
+
+    BatchWriter::BatchWriter(Context & c, size_t maxbytes, const std::chrono::microseconds & maxdelay, bool enc)
+        : ctx(c), limit(maxbytes), delay(maxdelay), encrypt(enc)
+    {
+        // coalesce up to one fragment of the frame mode
+        if(limit == 0)
+            limit = ctx.framePayload(encrypt);
+
+        if(limit == 0)
+            limit = 16 * 1024;
+
+        batch.reserve(batchHeaderSize + limit);
+        batch.resize(batchHeaderSize);
+    }
+
+    Result BatchWriter::write(const void* buf, size_t len)
+    {
+        // keep the batch under the limit, a larger message goes alone
+        if(count && batch.size() + 4 + len > limit)
+        {
+            if(auto res = flush(); ! res)
+                return res;
+        }
+
+        if(count == 0)
+            first = std::chrono::steady_clock::now();
+
+        auto pos = batch.size();
+        batch.resize(pos + 4 + len);
+        writeIntBE32(batch.data() + pos, len);
+        std::copy_n((const uint8_t*) buf, len, batch.data() + pos + 4);
+        count++;
+
+        if(batch.size() >= limit || std::chrono::steady_clock::now() >= deadline())
+            return flush();
+
+        return Result();
+    }
+
+    Result BatchWriter::flush(void)
+    {
+        if(count == 0)
+            return Result();
+
+        writeIntBE32(batch.data(), count);
+        auto res = ctx.sendMessage(batch.data(), batch.size(), encrypt);
+
+        batch.resize(batchHeaderSize);
+        count = 0;
+
+        return res;
+    }
+
+    Result BatchWriter::poll(void)
+    {
+        return std::chrono::steady_clock::now() < deadline() ? Result() : flush();
+    }
+
+    std::chrono::steady_clock::time_point BatchWriter::deadline(void) const
+    {
+        return count ? first + delay : std::chrono::steady_clock::time_point::max();
+    }
+
+    // BatchReader
+    Result BatchReader::read(BufferView & msg)
+    {
+        if(left == 0)
+        {
+            if(auto res = ctx.recvMessage(batch); ! res)
+                return res;
+
+            left = batch.size() < batchHeaderSize ? 0 : readIntBE32(batch.data());
+            pos = batchHeaderSize;
+
+            if(left == 0)
             {
-                buf = recvToken();
-                recv_tok.length = buf.size();
-                recv_tok.value = buf.data();
+                ctx.error(__FUNCTION__, "batch", GSS_S_DEFECTIVE_TOKEN, 0);
+                return Result("batch", GSS_S_DEFECTIVE_TOKEN, 0);
             }
         }
 
+        size_t len = pos + 4 <= batch.size() ? readIntBE32(batch.data() + pos) : batch.size();
+
+        if(batch.size() - pos < 4 + len)
+        {
+            left = 0;
+            ctx.error(__FUNCTION__, "batch message", GSS_S_DEFECTIVE_TOKEN, 0);
+            return Result("batch message", GSS_S_DEFECTIVE_TOKEN, 0);
+        }
+
+        msg.data = batch.data() + pos + 4;
+        msg.size = len;
+
+        pos += 4 + len;
+        left--;
+
+        return Result();
+    }
+
+    Result BatchReader::read(std::vector<uint8_t> & buf)
+    {
+        BufferView msg;
+        auto res = read(msg);
+
+        if(res)
+            buf.assign((const uint8_t*) msg.data, (const uint8_t*) msg.data + msg.size);
+
+        return res;
+    }
+
+    // ServiceContext
+    HandshakeStatus ServiceContext::acceptStep(const void* buf, size_t len, std::vector<uint8_t> & out)
+    {
+        out.clear();
+        handshake_result = Result();
+
+        if(! creds)
+        {
+            handshake_result = Result("credential", GSS_S_NO_CRED, 0);
+            return HandshakeStatus::Failed;
+        }
+
+        // first token: start a new handshake
+        if(established || ! context_handle)
+            resetContext();
+
+        OM_uint32 stat;
+
+        gss_buffer_desc recv_tok{ len, (void*) buf };
+        Buffer send_tok;
+
+        MetricTimer timer(MetricOp::AcceptSecContext, & stats);
+        auto ret = gss_accept_sec_context(& stat, context_handle.ptr(), creds.get(), & recv_tok, bindings.get(),
+                                     src_name.ptr(), & mech_types, send_tok.ptr(), & support_flags, & time_rec, nullptr);
+        timer.done(ret, len);
+
+        if(! send_tok.empty())
+            out.assign(send_tok.data(), send_tok.data() + send_tok.size());
+
+        if(ret == GSS_S_COMPLETE)
+        {
+            established = true;
+            setLifetime(time_rec);
+            return HandshakeStatus::Complete;
+        }
+
+        if(ret == GSS_S_CONTINUE_NEEDED)
+            return HandshakeStatus::Continue;
+
+        handshake_result = failure(__FUNCTION__, "gss_accept_sec_context", ret, stat);
+        resetContext();
+
+        return HandshakeStatus::Failed;
+    }
+
+    Result ServiceContext::acceptClient(void)
+    {
+        if(! creds)
+            return Result("credential", GSS_S_NO_CRED, 0);
+
+        resetContext();
+
+        std::vector<uint8_t> out;
+        auto status = HandshakeStatus::Continue;
+
+        while(status == HandshakeStatus::Continue)
+        {
+            // recv token
+            auto buf = recvToken();
+            status = acceptStep(buf.data(), buf.size(), out);
+
+            if(out.size())
+                sendToken(out.data(), out.size());
+        }
+
+        return handshake_result;
+    }
+
+    Result ServiceContext::acceptClient(const ChannelBindings & cb)
+    {
+        bindings = cb;
+        return acceptClient();
+    }
+
+    // ClientContext
+    HandshakeStatus ClientContext::initContext(gss_buffer_t recv_tok, std::vector<uint8_t> & out)
+    {
+        OM_uint32 stat;
+
+        Buffer send_tok;
+
+        MetricTimer timer(MetricOp::InitSecContext, & stats);
+        auto ret = gss_init_sec_context(& stat, creds ? creds.get() : GSS_C_NO_CREDENTIAL, context_handle.ptr(), src_name.get(), mechanismOid(mech_select), init_flags,
+                                    0, bindings.get(), recv_tok, & mech_types, send_tok.ptr(), & support_flags, & time_rec);
+        timer.done(ret, recv_tok ? recv_tok->length : 0);
+
+        if(! send_tok.empty())
+            out.assign(send_tok.data(), send_tok.data() + send_tok.size());
+
         if(ret == GSS_S_COMPLETE)
-            return true;
+        {
+            established = true;
+            setLifetime(time_rec);
+            return HandshakeStatus::Complete;
+        }
+
+        if(ret == GSS_S_CONTINUE_NEEDED)
+            return HandshakeStatus::Continue;
 
-        error(__FUNCTION__, "gss_init_sec_context", ret, stat);
-        return false;
+        handshake_result = failure(__FUNCTION__, "gss_init_sec_context", ret, stat);
+        context_handle.reset();
+
+        return HandshakeStatus::Failed;
+    }
+
+    HandshakeStatus ClientContext::initStart(std::string_view name, const NameType & type, std::vector<uint8_t> & out, int flags)
+    {
+        out.clear();
+        resetContext();
+        handshake_result = Result();
+
+        ErrorCodes err;
+        src_name = importName(name, type, &err);
+
+        if(! src_name)
+        {
+            handshake_result = failure(__FUNCTION__, err.func, err.code1, err.code2);
+            return HandshakeStatus::Failed;
+        }
+
+        init_flags = flags;
+        return initContext(GSS_C_NO_BUFFER, out);
+    }
+
+    HandshakeStatus ClientContext::initStep(const void* buf, size_t len, std::vector<uint8_t> & out)
+    {
+        out.clear();
+
+        if(established || ! context_handle)
+        {
+            handshake_result = Result("context", GSS_S_NO_CONTEXT, 0);
+            return HandshakeStatus::Failed;
+        }
+
+        gss_buffer_desc recv_tok{ len, (void*) buf };
+        return initContext(& recv_tok, out);
+    }
+
+    Result ClientContext::initConnect(std::string_view name, const NameType & type, int flags)
+    {
+        std::vector<uint8_t> out;
+        auto status = initStart(name, type, out, flags);
+
+        while(true)
+        {
+            if(out.size())
+                sendToken(out.data(), out.size());
+
+            if(status != HandshakeStatus::Continue)
+                break;
+
+            auto buf = recvToken();
+            status = initStep(buf.data(), buf.size(), out);
+        }
+
+        return handshake_result;
+    }
+
+    Result ClientContext::initConnect(std::string_view name, const NameType & type, const ChannelBindings & cb, int flags)
+    {
+        bindings = cb;
+        return initConnect(name, type, flags);
     }
 }
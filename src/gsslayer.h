@@ -25,10 +25,27 @@
 #include <gssapi/gssapi.h>
 #include <gssapi/gssapi_ext.h>
 
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <shared_mutex>
+#include <condition_variable>
+#include <tuple>
+#include <chrono>
 #include <memory>
 #include <vector>
+#include <optional>
+#include <memory_resource>
 #include <string>
-#include <list>
+#include <iosfwd>
+#include <iterator>
+#include <string_view>
+#include <type_traits>
+
+#include "gssmetrics.h"
 
 namespace Gss
 {
@@ -51,6 +68,13 @@ namespace Gss
         Both = GSS_C_BOTH          ///< Identifies applications that can initiate or accept security contexts
     };
 
+    enum class Mechanism
+    {
+        Default, ///< the mechanism chosen by the GSSAPI library
+        Krb5,    ///< Kerberos 5 only, 1.2.840.113554.1.2.2, no negotiation round
+        Spnego   ///< SPNEGO negotiation, 1.3.6.1.5.5.2
+    };
+
     enum ContextFlag
     {
         Delegate = GSS_C_DELEG_FLAG,        ///< delegated credentials are available by means of the delegated_cred_handle parameter
@@ -64,6 +88,13 @@ namespace Gss
         Transfer = GSS_C_TRANS_FLAG         ///< the resultant security context may be transferred to other processes by means of a call to gss_export_sec_context(3GSS)
     };
 
+    enum class HandshakeStatus
+    {
+        Continue, ///< the output token must be sent and the next peer token passed to the following step
+        Complete, ///< the security context is established
+        Failed    ///< the handshake failed, the output token (if any) may still be sent to the peer
+    };
+
     struct ErrorCodes
     {
         const char* func = nullptr;
@@ -71,53 +102,649 @@ namespace Gss
         OM_uint32 code2 = 0;
     };
 
-    gss_name_t importName(std::string_view name, const NameType &, ErrorCodes* = nullptr);
+    struct NameRelease { void operator()(gss_name_t) const; };
+    struct CredentialRelease { void operator()(gss_cred_id_t) const; };
+    struct SecContextRelease { void operator()(gss_ctx_id_t) const; };
+    struct OidSetRelease { void operator()(gss_OID_set) const; };
+
+    /// Handle: movable, non-copyable owner of a gss_* handle
+    template<typename Type, typename Release>
+    class Handle
+    {
+        Type handle = nullptr;
+
+    public:
+        Handle() = default;
+        explicit Handle(Type val) : handle(val) {}
+        ~Handle() { reset(); }
+
+        Handle(const Handle &) = delete;
+        Handle & operator= (const Handle &) = delete;
+
+        Handle(Handle && other) noexcept : handle(other.release()) {}
+        Handle & operator= (Handle && other) noexcept { if(this != & other) reset(other.release()); return *this; }
+
+        void                    reset(Type val = nullptr) { if(handle) Release()(handle); handle = val; }
+        Type                    release(void) { Type res = handle; handle = nullptr; return res; }
+
+        const Type &            get(void) const { return handle; }
+        /// in/out parameter for gss_* functions, the current handle is kept
+        Type*                   ptr(void) { return & handle; }
+
+        explicit operator bool(void) const { return handle != nullptr; }
+    };
+
+    typedef Handle<gss_name_t, NameRelease> Name;
+    typedef Handle<gss_cred_id_t, CredentialRelease> Credential;
+    typedef Handle<gss_ctx_id_t, SecContextRelease> SecContext;
+    typedef Handle<gss_OID_set, OidSetRelease> OidSet;
+
+    /// Buffer: owner of a gss_buffer_desc allocated by the mechanism
+    class Buffer
+    {
+        gss_buffer_desc buf{ 0, nullptr };
+
+    public:
+        Buffer() = default;
+        ~Buffer() { reset(); }
+
+        Buffer(const Buffer &) = delete;
+        Buffer & operator= (const Buffer &) = delete;
+
+        Buffer(Buffer && other) noexcept : buf(other.buf) { other.buf = { 0, nullptr }; }
+        Buffer & operator= (Buffer && other) noexcept;
+
+        void                    reset(void);
+
+        const uint8_t*          data(void) const { return (const uint8_t*) buf.value; }
+        size_t                  size(void) const { return buf.length; }
+        bool                    empty(void) const { return buf.length == 0; }
+
+        /// out parameter for gss_* functions, the current buffer is released
+        gss_buffer_t            ptr(void) { reset(); return & buf; }
+    };
+
+    Name importName(std::string_view name, const NameType &, ErrorCodes* = nullptr);
 
     std::string exportName(const gss_name_t &, ErrorCodes* = nullptr);
     std::string exportOID(const gss_OID &, ErrorCodes* = nullptr);
 
-    std::list<ContextFlag> exportFlags(int);
-    const char* flagName(const ContextFlag &);
+    /// oid of the mechanism, GSS_C_NO_OID for Mechanism::Default
+    gss_OID mechanismOid(const Mechanism &);
+
+    struct ContextFlagName
+    {
+        ContextFlag flag;
+        const char* name;
+    };
+
+    /// the known flags in bit order, with their names
+    inline constexpr ContextFlagName contextFlagNames[] = {
+        { ContextFlag::Delegate, "delegate" }, { ContextFlag::Mutual, "mutual" }, { ContextFlag::Replay, "replay" },
+        { ContextFlag::Sequence, "sequence" }, { ContextFlag::Confidential, "confidential" }, { ContextFlag::Integrity, "integrity" },
+        { ContextFlag::Anonymous, "anonymous" }, { ContextFlag::Protection, "protection" }, { ContextFlag::Transfer, "transfer" }
+    };
+
+    constexpr const char* flagName(const ContextFlag & flag)
+    {
+        for(auto & v : contextFlagNames)
+            if(v.flag == flag) return v.name;
+
+        return "unknown";
+    }
+
+    /// ContextFlags: the known ContextFlag bits of a GSS flags word, a value type iterated without allocation
+    class ContextFlags
+    {
+        OM_uint32 bits = 0;
+
+    public:
+        /// iterates the set flags in bit order, dereferences to ContextFlag by value
+        class Iterator
+        {
+            OM_uint32 bits = 0;
+            size_t pos = 0;
+
+            constexpr void      skip(void) { while(pos < std::size(contextFlagNames) && ! (bits & contextFlagNames[pos].flag)) ++pos; }
 
-    std::string error2str(OM_uint32 code1, OM_uint32 code2);
+        public:
+            constexpr Iterator(OM_uint32 val, size_t num) : bits(val), pos(num) { skip(); }
+
+            constexpr ContextFlag operator* (void) const { return contextFlagNames[pos].flag; }
+            constexpr Iterator & operator++ (void) { ++pos; skip(); return *this; }
+            constexpr bool      operator!= (const Iterator & it) const { return pos != it.pos; }
+            constexpr bool      operator== (const Iterator & it) const { return pos == it.pos; }
+        };
+
+        constexpr ContextFlags() = default;
+        constexpr explicit ContextFlags(OM_uint32 val) : bits(val) {}
+
+        constexpr bool          test(const ContextFlag & flag) const { return bits & flag; }
+        constexpr ContextFlags & set(const ContextFlag & flag) { bits |= flag; return *this; }
+        constexpr ContextFlags & reset(const ContextFlag & flag) { bits &= ~OM_uint32(flag); return *this; }
+        /// all flags of the argument are set
+        constexpr bool          contains(const ContextFlags & flags) const { return (bits & flags.bits) == flags.bits; }
+
+        constexpr size_t        count(void) const { size_t res = 0; for(auto & v : contextFlagNames) if(bits & v.flag) ++res; return res; }
+        constexpr bool          empty(void) const { return 0 == count(); }
+        constexpr OM_uint32     value(void) const { return bits; }
+
+        constexpr Iterator      begin(void) const { return Iterator(bits, 0); }
+        constexpr Iterator      end(void) const { return Iterator(bits, std::size(contextFlagNames)); }
+
+        constexpr bool          operator== (const ContextFlags & flags) const { return bits == flags.bits; }
+        constexpr bool          operator!= (const ContextFlags & flags) const { return bits != flags.bits; }
+    };
+
+    constexpr ContextFlags exportFlags(int flags) { return ContextFlags(flags); }
+
+    /// Oid: non-owning view of a gss_OID, compared and hashed by its DER bytes
+    class Oid
+    {
+        gss_OID oid = GSS_C_NO_OID;
+
+    public:
+        constexpr Oid() = default;
+        constexpr Oid(const gss_OID & val) : oid(val) {}
+
+        constexpr const gss_OID & get(void) const { return oid; }
+        const uint8_t*          data(void) const { return oid ? (const uint8_t*) oid->elements : nullptr; }
+        size_t                  size(void) const { return oid ? oid->length : 0; }
+        bool                    empty(void) const { return 0 == size(); }
+
+        /// FNV-1a of the DER bytes
+        size_t                  hash(void) const;
+
+        bool                    operator== (const Oid &) const;
+        bool                    operator!= (const Oid & v) const { return ! (*this == v); }
+
+        explicit operator bool(void) const { return ! empty(); }
+    };
+
+    /// the gss_oid_to_str form "{ 1 2 840 113554 1 2 2 }", decoded from the DER arcs without allocation
+    std::ostream & operator<< (std::ostream &, const Oid &);
+
+    /// importName, exportName, exportOID and the error messages may be called from any thread
+    std::string error2str(OM_uint32 code1, OM_uint32 code2, const gss_OID & mech = GSS_C_NO_OID);
+
+    /// cached error2str: the whole status chain, formatted once per (major, minor, mech) and kept until exit;
+    /// mechanism details of the first occurrence (such as principal names) are reused for the same codes
+    std::string_view errorMessage(OM_uint32 code1, OM_uint32 code2, const gss_OID & mech = GSS_C_NO_OID);
+
+    /// Result: success, or the failed call with its status codes; nothing is formatted until message()
+    class Result
+    {
+        ErrorCodes err;
+
+    public:
+        Result() = default;
+        Result(const char* func, OM_uint32 code1, OM_uint32 code2) : err{ func, code1, code2 } {}
+
+        explicit operator bool(void) const { return err.func == nullptr; }
+
+        const ErrorCodes &      codes(void) const { return err; }
+        const char*             func(void) const { return err.func; }
+        OM_uint32               code1(void) const { return err.code1; }
+        OM_uint32               code2(void) const { return err.code2; }
+
+        std::string_view        message(void) const { return errorMessage(err.code1, err.code2); }
+    };
+
+    /// ErrorLog: deferred sink of Context::error, the records are formatted and written by a background thread
+    class ErrorLog
+    {
+        struct Record
+        {
+            const char* func;
+            const char* subfunc;
+            OM_uint32 code1;
+            OM_uint32 code2;
+            gss_OID mech;
+        };
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        std::vector<Record> queue;
+        std::function<void(std::string_view)> writer;
+        std::thread worker;
+        std::atomic<size_t> lost{ 0 };
+        size_t limit = 4096;
+        size_t writing = 0;
+        bool shutdown = false;
+
+        void                    run(void);
+
+    public:
+        ErrorLog();
+        ~ErrorLog();
+
+        ErrorLog(const ErrorLog &) = delete;
+        ErrorLog & operator= (const ErrorLog &) = delete;
+
+        static ErrorLog &       instance(void);
+
+        /// queue one record without formatting, drop it when the queue is full; func and subfunc must be static strings
+        void                    push(const char* func, const char* subfunc, OM_uint32 code1, OM_uint32 code2, const gss_OID & mech = GSS_C_NO_OID);
+        /// wait until the queued records are written
+        void                    flush(void);
+
+        /// line writer, std::cerr by default; called on the log thread
+        void                    setWriter(std::function<void(std::string_view)>);
+        void                    setLimit(size_t);
+        size_t                  dropped(void) const { return lost; }
+    };
+
+    /// BufferView: non-owning message reference for the batch functions
+    struct BufferView
+    {
+        const void* data = nullptr;
+        size_t size = 0;
+    };
+
+    /// ChannelBindings: application data of gss_channel_bindings_struct, checked inside the handshake tokens
+    class ChannelBindings
+    {
+        std::vector<uint8_t> data;
+        mutable gss_channel_bindings_struct cb{};
+
+    public:
+        ChannelBindings() = default;
+        ChannelBindings(const void*, size_t);
+
+        /// "tls-exporter:" and the 32 byte EXPORTER-Channel-Binding value of the TLS 1.3 session (RFC 9266)
+        static ChannelBindings  tlsExporter(const void*, size_t);
+        /// "tls-server-end-point:" and the hash of the server certificate (RFC 5929)
+        static ChannelBindings  tlsServerEndPoint(const void*, size_t);
+
+        bool                    empty(void) const { return data.empty(); }
+        const std::vector<uint8_t> & applicationData(void) const { return data; }
+
+        /// GSS_C_NO_CHANNEL_BINDINGS when empty, valid while the object is not changed
+        gss_channel_bindings_t  get(void) const;
+    };
+
+    /// IovLength: section sizes of the contiguous frame [header][data][padding][trailer]
+    struct IovLength
+    {
+        size_t header = 0;
+        size_t data = 0;
+        size_t padding = 0;
+        size_t trailer = 0;
+
+        size_t frameSize(void) const { return header + data + padding + trailer; }
+    };
+
+    /// shared credential handle, released with the last reference
+    typedef std::shared_ptr<std::remove_pointer<gss_cred_id_t>::type> CredentialRef;
+
+    /// CredentialCache: process-wide cache of acquired credentials, keyed by (name, NameType, CredentialUsage)
+    class CredentialCache
+    {
+        struct Entry
+        {
+            CredentialRef cred;
+            std::chrono::steady_clock::time_point refresh;
+            std::chrono::steady_clock::time_point expired;
+            /// one caller acquires the new credential, the others keep the still valid one
+            bool refreshing = false;
+        };
+
+        void                    endRefresh(const std::tuple<std::string_view, NameType, int, Mechanism> &);
+
+        std::map<std::tuple<std::string, NameType, int, Mechanism>, Entry, std::less<>> entries;
+        std::chrono::seconds margin{ 60 };
+        std::mutex lock;
+
+        CredentialCache() = default;
+
+    public:
+        static CredentialCache & instance(void);
+
+        /// return the cached credential, acquire it again when its lifetime is close to the end
+        CredentialRef acquire(std::string_view, const NameType &, const CredentialUsage &, ErrorCodes* = nullptr, const Mechanism & = Mechanism::Default);
+
+        void setRefreshMargin(const std::chrono::seconds &);
+        void clear(void);
+    };
+
+    /// interned principal, 0 is no name
+    typedef uint32_t NameId;
+
+    /// NameCache: process-wide interned mechanism names, each canonical principal keeps one id for the process lifetime
+    class NameCache
+    {
+        struct Entry
+        {
+            std::string exported;
+            std::string display;
+        };
+
+        std::map<std::string, NameId, std::less<>> ids;
+        std::map<std::tuple<std::string, NameType, std::string>, NameId, std::less<>> imports;
+        std::deque<Entry> names;
+        mutable std::shared_mutex lock;
+
+        NameCache() = default;
+
+    public:
+        static NameCache & instance(void);
+
+        /// id of a name (srcName() after the handshake), canonicalized for the mechanism (Kerberos when not set); 0 on error
+        NameId intern(const gss_name_t &, const gss_OID & mech = GSS_C_NO_OID, ErrorCodes* = nullptr);
+        /// id of a configured string name, a repeated (string, type, mechanism) is resolved without GSSAPI calls
+        NameId intern(std::string_view, const NameType &, const gss_OID & mech = GSS_C_NO_OID, ErrorCodes* = nullptr);
+
+        /// gss_display_name form and gss_export_name token of an id, empty for an unknown id
+        std::string_view displayName(NameId) const;
+        std::string_view exportedName(NameId) const;
+
+        size_t size(void) const;
+    };
+
+    /// MechanismInfo: metadata of an installed mechanism
+    struct MechanismInfo
+    {
+        Oid oid;
+        std::vector<Oid> nameTypes;         ///< gss_inquire_names_for_mech
+        std::vector<std::string> attributes; ///< gss_display_mech_attr names of gss_inquire_attrs_for_mech
+    };
+
+    /// MechanismCache: process-wide metadata of the installed mechanisms, inquired once by the first instance() call
+    /// and read-only afterwards; call instance() at startup to keep the inquiry off the first handshake
+    class MechanismCache
+    {
+        /// owners of the oids referenced by infos
+        std::vector<OidSet> sets;
+        std::vector<MechanismInfo> infos;
+
+        MechanismCache();
+
+    public:
+        static const MechanismCache & instance(void);
+
+        const std::vector<MechanismInfo> & mechanisms(void) const { return infos; }
+
+        /// info of an installed mechanism, nullptr when unknown
+        const MechanismInfo* find(const Oid &) const;
+        const MechanismInfo* find(const Mechanism &) const;
+    };
 
     /// BaseContext
+    /// thread safety: by default a context must be used from one thread at a time.
+    /// with setConcurrentMode(true) the send functions (sendMessage, sendMIC, sendMICBatch, getMICBatch, wrap, getMIC, wrapIov)
+    /// and the recv functions (recvMessage, recvMIC, recvMICBatch, verifyMICBatch, unwrap, verifyMIC, unwrapIov) are serialized per direction,
+    /// so one reader and one writer thread may run in parallel; each direction keeps the wrap and the token transfer together,
+    /// so Replay and Sequence detection see tokens in order. refreshLifetime takes both direction locks and may run alongside them;
+    /// expiryTime, lifetimeLeft, expiresSoon, renewalTime, timeRec and pollExpiry read the deadline unlocked, call them from a thread
+    /// which does not overlap refreshLifetime. Handshake, export/import and credential functions are never concurrent.
     class Context
     {
+        struct Locks
+        {
+            std::mutex send;
+            std::mutex recv;
+        };
+
+        struct Renewal
+        {
+            std::function<void(Context &)> handler;
+            std::chrono::seconds margin;
+            std::atomic<bool> fired{ false };
+        };
+
+        std::unique_ptr<Locks> locks;
+        std::unique_ptr<Renewal> renewal;
+        std::chrono::steady_clock::time_point expiry = std::chrono::steady_clock::time_point::max();
+        std::vector<uint8_t> mic_arena;
+        std::vector<uint8_t> send_frame;
+        /// token buffer of the pmr recvMessage, behind a pointer so a move never reallocates it
+        std::unique_ptr<std::pmr::vector<uint8_t>> recv_token;
+        size_t frame_size = 0;
+        size_t max_message = 0;
+        /// wrapSizeLimit(frame_size) without and with encryption, computed once per frame size and context
+        size_t frame_limit[2] = { 0, 0 };
+
+        std::unique_lock<std::mutex> sendLock(void);
+        std::unique_lock<std::mutex> recvLock(void);
+
+        Result                  signBatch(const BufferView*, size_t count, std::vector<uint8_t> & frame);
+        Result                  verifyBatch(const BufferView*, size_t count, const void* frame, size_t, std::vector<bool>* verified);
+        Result                  unwrapStream(void* frame, size_t, uint8_t* & data, size_t & datasz);
+        Result                  wrapBuffer(const void*, size_t, Buffer &, bool encrypt);
+        Result                  unwrapBuffer(const void*, size_t, Buffer &);
+        Result                  micBuffer(const void*, size_t, Buffer &);
+        Result                  checkMIC(const void* msg, size_t, const void* mic, size_t);
+        Result                  sendFragments(const void*, size_t, bool encrypt);
+        Result                  checkFragment(const uint8_t*, size_t, uint32_t seq, bool & last) const;
+        size_t                  frameLimit(bool encrypt);
+        void                    checkExpiry(void);
+
     protected:
         gss_OID mech_types = nullptr;
-        gss_ctx_id_t context_handle = nullptr;
-        gss_name_t src_name = nullptr;
-        gss_name_t service_name = nullptr;
-        gss_cred_id_t creds = nullptr;
+        SecContext context_handle;
+        Name src_name;
+        Name service_name;
+        CredentialRef creds;
         OM_uint32 support_flags = 0;
         OM_uint32 time_rec = 0;
+        Mechanism mech_select = Mechanism::Default;
+        bool established = false;
+        ContextStats stats;
+        Result handshake_result;
+        NameId src_name_id = 0;
+        ChannelBindings bindings;
+
+        void                    resetContext(void);
+        /// set time_rec and the cached expiry deadline, GSS_C_INDEFINITE never expires
+        void                    setLifetime(OM_uint32);
+        /// report through error() and return the failed result
+        Result                  failure(const char* func, const char* subfunc, OM_uint32 code1, OM_uint32 code2) const;
 
     public:
         Context() = default;
-        virtual ~Context();
+        virtual ~Context() = default;
 
         Context(const Context &) = delete;
         Context & operator= (const Context &) = delete;
 
-        virtual std::vector<uint8_t> recvToken(void) = 0;
-        virtual void sendToken(const void*, size_t) = 0;
+        /// the moved-to context takes the receive token buffer with its memory resource, the moved-from one has none
+        Context(Context &&) noexcept = default;
+        Context & operator= (Context &&) noexcept = default;
+
+        /// blocking transport adapter, used by acceptClient, initConnect and the message functions
+        virtual std::vector<uint8_t> recvToken(void);
+        virtual void sendToken(const void*, size_t);
+        /// receive into reused storage, false on transport failure; the default implementation copies from recvToken()
+        /// and treats an empty token as failure, override it to reuse the storage (TokenTransport, LoopbackContext)
+        virtual bool recvTokenInto(std::pmr::vector<uint8_t> &);
+        /// failure hook, the default implementation queues the record to ErrorLog
         virtual void error(const char* func, const char* subfunc, OM_uint32 code1, OM_uint32 code2) const;
 
+        /// empty on error, the Result overload keeps the failed call and its codes
         std::vector<uint8_t>    recvMessage(void);
-        bool                    sendMessage(const void*, size_t, bool encrypt = true);
+        Result                  recvMessage(std::vector<uint8_t> & out);
+        /// allocation-free in steady state when recvTokenInto is overridden: the token buffer is reused and unwrapped in place,
+        /// out keeps its capacity
+        Result                  recvMessage(std::pmr::vector<uint8_t> & out);
+        /// memory for the internal receive token buffer, nullptr for the default resource; the buffer keeps it across moves
+        void                    setMemoryResource(std::pmr::memory_resource*);
+        Result                  sendMessage(const void*, size_t, bool encrypt = true);
+
+        Result                  recvMIC(const void*, size_t);
+        Result                  sendMIC(const void*, size_t);
+
+        /// transport-free primitives, for callers which move the tokens themselves
+        Result                  wrap(const void*, size_t, Buffer & out, bool encrypt = true);
+        Result                  unwrap(const void*, size_t, Buffer & out);
+        Result                  getMIC(const void*, size_t, Buffer & out);
+        Result                  verifyMIC(const void* msg, size_t, const void* mic, size_t);
+
+        /// batch MIC: one framed token [count][len, mic]... for all messages
+        Result                  getMICBatch(const BufferView*, size_t count, std::vector<uint8_t> & frame);
+        Result                  verifyMICBatch(const BufferView*, size_t count, const void* frame, size_t, std::vector<bool>* verified = nullptr);
+
+        Result                  recvMICBatch(const BufferView*, size_t count, std::vector<bool>* verified = nullptr);
+        Result                  sendMICBatch(const BufferView*, size_t count);
+
+        /// maximum input size which wraps into a token of the given size, 0 on error (gss_wrap_size_limit)
+        size_t                  wrapSizeLimit(size_t, bool encrypt = true) const;
+        /// exact token overhead (header, padding, trailer) for a message of the given size, 0 on error
+        size_t                  wrapOverhead(size_t, bool encrypt = true) const;
+
+        /// frame mode: sendMessage splits the payload into [seq BE32][last flag][data] fragments,
+        /// each wrapped token fits the frame size, and recvMessage joins them up to maxMessage bytes;
+        /// both peers must use the same mode, 0 switches back to one token per message;
+        /// small messages are coalesced up to a frame by BatchWriter with maxBytes = 0
+        void                    setFrameSize(size_t, size_t maxMessage = 16 * 1024 * 1024);
+        size_t                  frameSize(void) const { return frame_size; }
+        /// message bytes carried by one fragment of the established context, 0 without frame mode or on error
+        size_t                  framePayload(bool encrypt = true);
 
-        bool                    recvMIC(const void*, size_t);
-        bool                    sendMIC(const void*, size_t);
+        Result                  wrapIovLength(size_t, IovLength &, bool encrypt = true) const;
+        Result                  wrapIov(void* frame, const IovLength &, bool encrypt = true);
+        Result                  unwrapIov(void* frame, size_t, uint8_t* & data, size_t & datasz);
 
-        const gss_name_t &      srcName(void) const { return src_name; }
+        /// enable per-direction serialization, call before the context is shared between threads
+        void                    setConcurrentMode(bool);
+        bool                    isConcurrentMode(void) const { return locks != nullptr; }
+
+        const gss_name_t &      srcName(void) const { return src_name.get(); }
+        /// NameCache id of srcName(), resolved once per handshake
+        NameId                  srcNameId(void);
         const gss_OID &         mechTypes(void) const { return mech_types; }
         const OM_uint32 &       supportFlags(void) const { return support_flags; }
         const OM_uint32 &       timeRec(void) const { return time_rec; }
 
-        bool acquireCredential(std::string_view, const NameType &, const CredentialUsage & = Gss::CredentialUsage::Accept);
+        /// monotonic deadline of the context from timeRec(), time_point::max() when indefinite or not established
+        std::chrono::steady_clock::time_point expiryTime(void) const { return expiry; }
+        /// seconds left from the cached deadline, without GSSAPI calls
+        std::chrono::seconds    lifetimeLeft(void) const;
+        bool                    expiresSoon(const std::chrono::seconds & margin = std::chrono::seconds(60)) const;
+        /// query gss_context_time and update timeRec() and expiryTime(), under both direction locks in concurrent mode
+        Result                  refreshLifetime(void);
+
+        /// the handler is called once per handshake, from the message functions or pollExpiry(), when less than margin is left;
+        /// from a message function it runs under that direction lock, from pollExpiry() without a lock;
+        /// it must not use this context, start the re-handshake on a new one
+        void                    setExpiryHandler(std::function<void(Context &)>, const std::chrono::seconds & margin = std::chrono::seconds(60));
+        /// time of the handler call, call pollExpiry() from the event loop at it; time_point::max() without handler
+        std::chrono::steady_clock::time_point renewalTime(void) const;
+        void                    pollExpiry(void);
+        bool                    isEstablished(void) const { return established; }
+        /// why the last acceptStep, initStart or initStep failed
+        const Result &          handshakeResult(void) const { return handshake_result; }
+        /// per-context counters, zero without GSSLAYER_METRICS; not synchronized, in concurrent mode read them while both directions are idle
+        const ContextStats &    contextStats(void) const { return stats; }
+
+        /// serialize the established context for another process, requires ContextFlag::Transfer; the context is released
+        std::vector<uint8_t>    exportContext(void);
+        Result                  exportContext(std::vector<uint8_t> & out);
+        /// restore the context from exportContext() data, with src_name, mech_types, support_flags and time_rec
+        Result                  importContext(const void*, size_t);
+
+        /// used by every handshake step, both peers must set the same data; a peer without bindings is handled by the mechanism
+        void                    setChannelBindings(const ChannelBindings & cb) { bindings = cb; }
+        const ChannelBindings & channelBindings(void) const { return bindings; }
+
+        /// mechanism of the next handshake: the initiator requests it from gss_init_sec_context,
+        /// acquireCredential limits the credential (and so the acceptor) to it; Krb5 saves the SPNEGO negotiation
+        void                    setMechanism(const Mechanism & mech) { mech_select = mech; }
+        const Mechanism &       mechanism(void) const { return mech_select; }
+
+        /// acquire own credential, or borrow it from CredentialCache when cached is set
+        Result acquireCredential(std::string_view, const NameType &, const CredentialUsage & = Gss::CredentialUsage::Accept, bool cached = false);
+
+        void                    setCredential(const CredentialRef & cred) { creds = cred; }
+        const CredentialRef &   credential(void) const { return creds; }
+
+        /// name types of mechTypes() from MechanismCache
+        const std::vector<Oid> & mechNames(void) const;
+    };
+
+    /// StreamWriter: sends a payload of any size as wrapped chunks, each chunk is [seq BE32][last flag][data]
+    class StreamWriter
+    {
+        Context & ctx;
+        std::vector<uint8_t> chunk;
+        size_t limit = 0;
+        uint32_t seq = 0;
+        bool encrypt = true;
+
+        Result                  flush(bool last);
 
-        std::list<std::string> mechNames(void) const;
+    public:
+        /// the chunk size is taken from wrapSizeLimit() for the given token size
+        StreamWriter(Context &, size_t tokensz = 64 * 1024, bool encrypt = true);
+
+        bool                    isValid(void) const { return 0 < limit; }
+        size_t                  chunkSize(void) const { return limit; }
+
+        Result                  write(const void*, size_t);
+        /// send the last chunk, the writer may be used for the next stream
+        Result                  finish(void);
+    };
+
+    /// StreamReader: receives the chunks of StreamWriter in order
+    class StreamReader
+    {
+        Context & ctx;
+        uint32_t seq = 0;
+        bool finished = false;
+
+    public:
+        explicit StreamReader(Context & c) : ctx(c) {}
+
+        /// next plaintext chunk (may be empty), false on error
+        Result                  read(std::vector<uint8_t> &);
+        /// the last chunk was read, the reader may be used for the next stream
+        bool                    isFinished(void) const { return finished; }
+    };
+
+    /// BatchWriter: coalesces small messages into one wrapped token [count BE32]([len BE32][data])...
+    class BatchWriter
+    {
+        Context & ctx;
+        std::vector<uint8_t> batch;
+        size_t limit = 0;
+        std::chrono::microseconds delay;
+        std::chrono::steady_clock::time_point first;
+        uint32_t count = 0;
+        bool encrypt = true;
+
+    public:
+        /// a batch is sent when it reaches maxBytes or its first message waited maxDelay;
+        /// maxBytes 0 fills one framePayload() of a context in frame mode (16K without it)
+        BatchWriter(Context &, size_t maxBytes = 16 * 1024, const std::chrono::microseconds & maxDelay = std::chrono::milliseconds(1), bool encrypt = true);
+
+        Result                  write(const void*, size_t);
+        /// send the pending messages now
+        Result                  flush(void);
+        /// flush when the delay is over, call from the event loop at deadline()
+        Result                  poll(void);
+
+        /// time of the delayed flush, time_point::max() without pending messages
+        std::chrono::steady_clock::time_point deadline(void) const;
+        size_t                  pending(void) const { return count; }
+    };
+
+    /// BatchReader: receives the tokens of BatchWriter and returns the messages one by one
+    class BatchReader
+    {
+        Context & ctx;
+        std::vector<uint8_t> batch;
+        size_t pos = 0;
+        uint32_t left = 0;
+
+    public:
+        explicit BatchReader(Context & c) : ctx(c) {}
+
+        /// next message, a new token is received when the current batch is used up
+        Result                  read(std::vector<uint8_t> &);
+        /// the same without copy, the view is valid until the next read
+        Result                  read(BufferView &);
+        /// messages left in the current batch
+        size_t                  pending(void) const { return left; }
     };
 
     /// ServiceContext
@@ -126,16 +753,50 @@ namespace Gss
     public:
         ServiceContext() = default;
 
-        bool acceptClient(void);
+        /// non-blocking handshake: pass one client token, send back the output token if not empty
+        HandshakeStatus acceptStep(const void*, size_t, std::vector<uint8_t> & out);
+
+        Result acceptClient(void);
+        Result acceptClient(const ChannelBindings &);
     };
 
     /// ClientContext
     class ClientContext : public Context
     {
+        OM_uint32 init_flags = 0;
+
+        HandshakeStatus initContext(gss_buffer_t, std::vector<uint8_t> & out);
+
     public:
         ClientContext() = default;
 
-        bool initConnect(std::string_view, const NameType &, int flags = GSS_C_MUTUAL_FLAG | GSS_C_REPLAY_FLAG);
+        /// non-blocking handshake: initStart produces the first token, initStep consumes each service token
+        HandshakeStatus initStart(std::string_view, const NameType &, std::vector<uint8_t> & out, int flags = GSS_C_MUTUAL_FLAG | GSS_C_REPLAY_FLAG);
+        HandshakeStatus initStep(const void*, size_t, std::vector<uint8_t> & out);
+
+        Result initConnect(std::string_view, const NameType &, int flags = GSS_C_MUTUAL_FLAG | GSS_C_REPLAY_FLAG);
+        Result initConnect(std::string_view, const NameType &, const ChannelBindings &, int flags = GSS_C_MUTUAL_FLAG | GSS_C_REPLAY_FLAG);
+    };
+
+    /// factory: rebuild a working context of the given type from Context::exportContext() data
+    template<typename ContextType = Context>
+    std::optional<ContextType> importContext(const void* buf, size_t len)
+    {
+        ContextType ctx;
+
+        if(ctx.importContext(buf, len))
+            return std::optional<ContextType>(std::move(ctx));
+
+        return std::nullopt;
+    }
+}
+
+namespace std
+{
+    template<>
+    struct hash<Gss::Oid>
+    {
+        size_t operator()(const Gss::Oid & oid) const { return oid.hash(); }
     };
 }
 
@@ -0,0 +1,180 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <thread>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include "gssloopback.h"
+
+namespace Gss
+{
+    // RingBuffer
+    RingBuffer::RingBuffer(size_t capacity)
+    {
+        size_t sz = 64;
+
+        while(sz < capacity)
+            sz <<= 1;
+
+        buf.reset(new uint8_t[sz]);
+        mask = sz - 1;
+    }
+
+    size_t RingBuffer::size(void) const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    size_t RingBuffer::write(const void* ptr, size_t len)
+    {
+        auto pos = head.load(std::memory_order_relaxed);
+        auto used = pos - tail.load(std::memory_order_acquire);
+
+        len = std::min(len, capacity() - used);
+
+        if(len)
+        {
+            auto off = pos & mask;
+            auto part = std::min(len, capacity() - off);
+
+            std::memcpy(buf.get() + off, ptr, part);
+            std::memcpy(buf.get(), (const uint8_t*) ptr + part, len - part);
+
+            head.store(pos + len, std::memory_order_release);
+        }
+
+        return len;
+    }
+
+    size_t RingBuffer::read(void* ptr, size_t len)
+    {
+        auto pos = tail.load(std::memory_order_relaxed);
+        auto used = head.load(std::memory_order_acquire) - pos;
+
+        len = std::min(len, used);
+
+        if(len)
+        {
+            auto off = pos & mask;
+            auto part = std::min(len, capacity() - off);
+
+            std::memcpy(ptr, buf.get() + off, part);
+            std::memcpy((uint8_t*) ptr + part, buf.get(), len - part);
+
+            tail.store(pos + len, std::memory_order_release);
+        }
+
+        return len;
+    }
+
+    // LoopbackChannel
+    void LoopbackChannel::writeAll(const void* ptr, size_t len)
+    {
+        auto data = (const uint8_t*) ptr;
+
+        while(len)
+        {
+            if(closed)
+                throw std::runtime_error("loopback closed");
+
+            auto sz = ring.write(data, len);
+
+            if(sz == 0)
+                std::this_thread::yield();
+
+            data += sz;
+            len -= sz;
+        }
+    }
+
+    void LoopbackChannel::readAll(void* ptr, size_t len)
+    {
+        auto data = (uint8_t*) ptr;
+
+        while(len)
+        {
+            auto sz = ring.read(data, len);
+
+            if(sz == 0)
+            {
+                // the peer may close after the last write
+                if(closed && ring.size() == 0)
+                    throw std::runtime_error("loopback closed");
+
+                std::this_thread::yield();
+            }
+
+            data += sz;
+            len -= sz;
+        }
+    }
+
+    void LoopbackChannel::sendToken(const void* buf, size_t len)
+    {
+        uint8_t hdr[4] = { uint8_t(len >> 24), uint8_t(len >> 16), uint8_t(len >> 8), uint8_t(len) };
+
+        writeAll(hdr, sizeof(hdr));
+        writeAll(buf, len);
+    }
+
+    std::vector<uint8_t> LoopbackChannel::recvToken(void)
+    {
+        uint8_t hdr[4];
+        readAll(hdr, sizeof(hdr));
+
+        size_t len = (size_t(hdr[0]) << 24) | (size_t(hdr[1]) << 16) | (size_t(hdr[2]) << 8) | size_t(hdr[3]);
+        std::vector<uint8_t> res(len);
+
+        readAll(res.data(), res.size());
+        return res;
+    }
+
+    void LoopbackChannel::recvToken(std::pmr::vector<uint8_t> & buf)
+    {
+        uint8_t hdr[4];
+        readAll(hdr, sizeof(hdr));
+
+        size_t len = (size_t(hdr[0]) << 24) | (size_t(hdr[1]) << 16) | (size_t(hdr[2]) << 8) | size_t(hdr[3]);
+        buf.resize(len);
+
+        readAll(buf.data(), buf.size());
+    }
+
+    // LoopbackEndpoint
+    LoopbackEndpoint::~LoopbackEndpoint()
+    {
+        if(in)
+            in->close();
+
+        if(out)
+            out->close();
+    }
+
+    std::pair<LoopbackEndpoint, LoopbackEndpoint> makeLoopback(size_t capacity)
+    {
+        auto ch1 = std::make_shared<LoopbackChannel>(capacity);
+        auto ch2 = std::make_shared<LoopbackChannel>(capacity);
+
+        return std::make_pair(LoopbackEndpoint(ch1, ch2), LoopbackEndpoint(ch2, ch1));
+    }
+}
@@ -0,0 +1,124 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _GSS_LOOPBACK_
+#define _GSS_LOOPBACK_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <memory_resource>
+
+#include "gsslayer.h"
+
+namespace Gss
+{
+    /// RingBuffer: lock-free single producer, single consumer byte ring
+    class RingBuffer
+    {
+        std::unique_ptr<uint8_t[]> buf;
+        size_t mask = 0;
+
+        alignas(64) std::atomic<size_t> head{ 0 }; ///< producer position
+        alignas(64) std::atomic<size_t> tail{ 0 }; ///< consumer position
+
+    public:
+        /// capacity is rounded up to a power of two
+        explicit RingBuffer(size_t capacity);
+
+        RingBuffer(const RingBuffer &) = delete;
+        RingBuffer & operator= (const RingBuffer &) = delete;
+
+        /// non-blocking, return the number of bytes copied
+        size_t                  write(const void*, size_t);
+        size_t                  read(void*, size_t);
+
+        size_t                  capacity(void) const { return mask + 1; }
+        size_t                  size(void) const;
+    };
+
+    /// LoopbackChannel: one direction of the loopback, tokens are framed as [len BE32][data]
+    class LoopbackChannel
+    {
+        RingBuffer ring;
+        std::atomic<bool> closed{ false };
+
+        void                    writeAll(const void*, size_t);
+        void                    readAll(void*, size_t);
+
+    public:
+        explicit LoopbackChannel(size_t capacity) : ring(capacity) {}
+
+        /// blocking while the ring is full or empty, throw std::runtime_error after close()
+        void                    sendToken(const void*, size_t);
+        std::vector<uint8_t>    recvToken(void);
+        void                    recvToken(std::pmr::vector<uint8_t> &);
+
+        void                    close(void) { closed = true; }
+        bool                    empty(void) const { return ring.size() == 0; }
+    };
+
+    /// LoopbackEndpoint: in-memory token transport, one side of makeLoopback()
+    class LoopbackEndpoint
+    {
+        std::shared_ptr<LoopbackChannel> in;
+        std::shared_ptr<LoopbackChannel> out;
+
+    public:
+        LoopbackEndpoint() = default;
+        LoopbackEndpoint(std::shared_ptr<LoopbackChannel> cin, std::shared_ptr<LoopbackChannel> cout) : in(std::move(cin)), out(std::move(cout)) {}
+        ~LoopbackEndpoint();
+
+        LoopbackEndpoint(const LoopbackEndpoint &) = delete;
+        LoopbackEndpoint & operator= (const LoopbackEndpoint &) = delete;
+
+        LoopbackEndpoint(LoopbackEndpoint &&) noexcept = default;
+        LoopbackEndpoint & operator= (LoopbackEndpoint &&) noexcept = default;
+
+        std::vector<uint8_t>    recvToken(void) { return in->recvToken(); }
+        void                    recvToken(std::pmr::vector<uint8_t> & buf) { in->recvToken(buf); }
+        void                    sendToken(const void* buf, size_t len) { out->sendToken(buf, len); }
+    };
+
+    /// connected endpoint pair; on one thread the capacity must hold all tokens in flight
+    std::pair<LoopbackEndpoint, LoopbackEndpoint> makeLoopback(size_t capacity = 1024 * 1024);
+
+    /// LoopbackContext: ClientContext or ServiceContext over the in-memory transport
+    template<typename BaseContext>
+    class LoopbackContext : public BaseContext
+    {
+        LoopbackEndpoint endpoint;
+
+    public:
+        LoopbackContext() = default;
+        explicit LoopbackContext(LoopbackEndpoint && ep) : endpoint(std::move(ep)) {}
+
+        void                    setEndpoint(LoopbackEndpoint && ep) { endpoint = std::move(ep); }
+
+        // Context override
+        std::vector<uint8_t>    recvToken(void) override { return endpoint.recvToken(); }
+        void                    sendToken(const void* buf, size_t len) override { endpoint.sendToken(buf, len); }
+        bool                    recvTokenInto(std::pmr::vector<uint8_t> & buf) override { endpoint.recvToken(buf); return true; }
+    };
+}
+
+#endif
@@ -0,0 +1,200 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+#include "gssmetrics.h"
+
+namespace Gss
+{
+    const char* metricName(const MetricOp & op)
+    {
+        switch(op)
+        {
+            case MetricOp::Wrap: return "gss_wrap";
+            case MetricOp::Unwrap: return "gss_unwrap";
+            case MetricOp::GetMIC: return "gss_get_mic";
+            case MetricOp::VerifyMIC: return "gss_verify_mic";
+            case MetricOp::AcceptSecContext: return "gss_accept_sec_context";
+            case MetricOp::InitSecContext: return "gss_init_sec_context";
+            case MetricOp::AcquireCred: return "gss_acquire_cred";
+            case MetricOp::ImportName: return "gss_import_name";
+            case MetricOp::ExportContext: return "gss_export_sec_context";
+            case MetricOp::ImportContext: return "gss_import_sec_context";
+            default: break;
+        }
+
+        return "unknown";
+    }
+
+    uint64_t OpMetrics::percentile(double quantile) const
+    {
+        uint64_t total = 0;
+
+        for(auto & val : latency)
+            total += val;
+
+        if(total == 0)
+            return 0;
+
+        auto limit = static_cast<uint64_t>(quantile * total);
+        uint64_t sum = 0;
+
+        for(size_t it = 0; it < latency.size(); ++it)
+        {
+            sum += latency[it];
+
+            if(sum > limit)
+                return (uint64_t(1) << (it + 1)) - 1;
+        }
+
+        return (uint64_t(1) << latency.size()) - 1;
+    }
+
+#ifdef GSSLAYER_METRICS
+    namespace
+    {
+        struct OpCounters
+        {
+            std::atomic<uint64_t> calls{ 0 };
+            std::atomic<uint64_t> errors{ 0 };
+            std::atomic<uint64_t> bytes{ 0 };
+            std::array<std::atomic<uint64_t>, metricBuckets> latency{};
+        };
+
+        /// MetricShard: counters of one thread, written by the owner and read by metricsSnapshot()
+        struct MetricShard
+        {
+            std::array<OpCounters, static_cast<size_t>(MetricOp::Count)> ops;
+            std::atomic<uint64_t> handshakes{ 0 };
+            std::atomic<uint64_t> handshakeFailures{ 0 };
+            std::atomic<uint64_t> handshakeRounds{ 0 };
+        };
+
+        // the shards outlive their threads, so the totals stay monotonic
+        std::mutex shardsLock;
+        std::list<std::unique_ptr<MetricShard>> shards;
+
+        MetricShard & localShard(void)
+        {
+            thread_local MetricShard* shard = []()
+            {
+                const std::scoped_lock guard{ shardsLock };
+                return shards.emplace_back(std::make_unique<MetricShard>()).get();
+            }();
+
+            return *shard;
+        }
+
+        /// single writer: a plain load and store instead of a locked read-modify-write
+        inline void add(std::atomic<uint64_t> & val, uint64_t num)
+        {
+            val.store(val.load(std::memory_order_relaxed) + num, std::memory_order_relaxed);
+        }
+
+        inline size_t bucket(uint64_t ns)
+        {
+            size_t res = 63 - __builtin_clzll(ns | 1);
+            return std::min(res, metricBuckets - 1);
+        }
+    }
+
+    void MetricTimer::done(OM_uint32 major, size_t bytes) const
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        auto & shard = localShard();
+        auto & counters = shard.ops[static_cast<size_t>(op)];
+        bool failed = GSS_ERROR(major);
+
+        add(counters.calls, 1);
+        add(counters.bytes, bytes);
+        add(counters.latency[bucket(ns)], 1);
+
+        if(failed)
+            add(counters.errors, 1);
+
+        bool handshake = op == MetricOp::AcceptSecContext || op == MetricOp::InitSecContext;
+
+        if(handshake)
+        {
+            add(shard.handshakeRounds, 1);
+
+            if(failed)
+                add(shard.handshakeFailures, 1);
+            else
+            if(major == GSS_S_COMPLETE)
+                add(shard.handshakes, 1);
+        }
+
+        if(! stats)
+            return;
+
+        // the send and receive paths run in parallel in concurrent mode, each one touches only its own fields
+        switch(op)
+        {
+            case MetricOp::Wrap: stats->wraps++; stats->wrapBytes += bytes; stats->sendErrors += failed; break;
+            case MetricOp::GetMIC: stats->mics++; stats->micBytes += bytes; stats->sendErrors += failed; break;
+            case MetricOp::Unwrap: stats->unwraps++; stats->unwrapBytes += bytes; stats->recvErrors += failed; break;
+            case MetricOp::VerifyMIC: stats->verifies++; stats->verifyBytes += bytes; stats->recvErrors += failed; break;
+            case MetricOp::AcceptSecContext:
+            case MetricOp::InitSecContext: stats->handshakeRounds++; stats->handshakeFailures += failed; break;
+            default: break;
+        }
+    }
+
+    MetricsSnapshot metricsSnapshot(void)
+    {
+        MetricsSnapshot res;
+        const std::scoped_lock guard{ shardsLock };
+
+        for(auto & shard : shards)
+        {
+            for(size_t op = 0; op < res.ops.size(); ++op)
+            {
+                auto & src = shard->ops[op];
+                auto & dst = res.ops[op];
+
+                dst.calls += src.calls.load(std::memory_order_relaxed);
+                dst.errors += src.errors.load(std::memory_order_relaxed);
+                dst.bytes += src.bytes.load(std::memory_order_relaxed);
+
+                for(size_t it = 0; it < metricBuckets; ++it)
+                    dst.latency[it] += src.latency[it].load(std::memory_order_relaxed);
+            }
+
+            res.handshakes += shard->handshakes.load(std::memory_order_relaxed);
+            res.handshakeFailures += shard->handshakeFailures.load(std::memory_order_relaxed);
+            res.handshakeRounds += shard->handshakeRounds.load(std::memory_order_relaxed);
+        }
+
+        return res;
+    }
+#else
+    MetricsSnapshot metricsSnapshot(void)
+    {
+        return MetricsSnapshot();
+    }
+#endif
+}
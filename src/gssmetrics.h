@@ -0,0 +1,119 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _GSS_METRICS_
+#define _GSS_METRICS_
+
+#include <gssapi/gssapi.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace Gss
+{
+    /// instrumented GSS calls
+    enum class MetricOp { Wrap, Unwrap, GetMIC, VerifyMIC, AcceptSecContext, InitSecContext, AcquireCred, ImportName, ExportContext, ImportContext, Count };
+
+    const char* metricName(const MetricOp &);
+
+    /// latency bucket n counts the calls of [2^n, 2^(n+1)) nanoseconds
+    constexpr size_t metricBuckets = 40;
+
+    /// OpMetrics: totals of one call, bytes is the input length
+    struct OpMetrics
+    {
+        uint64_t calls = 0;
+        uint64_t errors = 0;
+        uint64_t bytes = 0;
+        std::array<uint64_t, metricBuckets> latency{};
+
+        /// upper bound of the latency bucket for the given quantile (0.5, 0.99), in nanoseconds
+        uint64_t percentile(double) const;
+    };
+
+    /// MetricsSnapshot: sum of the per-thread counters at one moment, diff two snapshots for rates
+    struct MetricsSnapshot
+    {
+        std::array<OpMetrics, static_cast<size_t>(MetricOp::Count)> ops{};
+        uint64_t handshakes = 0;
+        uint64_t handshakeFailures = 0;
+        uint64_t handshakeRounds = 0;
+
+        const OpMetrics &       operator[](const MetricOp & op) const { return ops[static_cast<size_t>(op)]; }
+    };
+
+    /// ContextStats: counters of one context, each field is written only under its direction lock (send, receive or handshake);
+    /// the fields are plain integers, read them while both directions are idle or only the fields of the calling direction
+    struct ContextStats
+    {
+        // send direction
+        uint64_t wraps = 0;
+        uint64_t wrapBytes = 0;
+        uint64_t mics = 0;
+        uint64_t micBytes = 0;
+        uint64_t sendErrors = 0;
+        // receive direction
+        uint64_t unwraps = 0;
+        uint64_t unwrapBytes = 0;
+        uint64_t verifies = 0;
+        uint64_t verifyBytes = 0;
+        uint64_t recvErrors = 0;
+        // handshake
+        uint64_t handshakeRounds = 0;
+        uint64_t handshakeFailures = 0;
+    };
+
+    /// built with GSSLAYER_METRICS
+    constexpr bool metricsEnabled(void)
+    {
+#ifdef GSSLAYER_METRICS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /// process-wide counters, all zero without GSSLAYER_METRICS
+    MetricsSnapshot metricsSnapshot(void);
+
+    /// MetricTimer: time one GSS call and count it for the thread and the context; empty without GSSLAYER_METRICS
+    class MetricTimer
+    {
+#ifdef GSSLAYER_METRICS
+        MetricOp op;
+        ContextStats* stats;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        explicit MetricTimer(const MetricOp & o, ContextStats* st = nullptr) : op(o), stats(st), start(std::chrono::steady_clock::now()) {}
+
+        void                    done(OM_uint32 major, size_t bytes) const;
+#else
+    public:
+        explicit MetricTimer(const MetricOp &, ContextStats* = nullptr) {}
+
+        void                    done(OM_uint32, size_t) const {}
+#endif
+    };
+}
+
+#endif
@@ -0,0 +1,267 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _GSS_SESSION_
+#define _GSS_SESSION_
+
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "gsslayer.h"
+
+namespace Gss
+{
+    /// SessionHandle: slot and generation of a SessionTable entry, a handle of an erased session never resolves again
+    struct SessionHandle
+    {
+        uint32_t slot = 0;
+        uint32_t generation = 0;
+
+        explicit operator bool(void) const { return 0 < generation; }
+
+        bool operator== (const SessionHandle & h) const { return slot == h.slot && generation == h.generation; }
+        bool operator!= (const SessionHandle & h) const { return ! (*this == h); }
+    };
+
+    /// SessionTable: established contexts keyed by connection id
+    /// the ids are spread over Shards, each with its own lock, id index and slabs of SlabSize slots;
+    /// the slots of erased sessions are reused, a context keeps its address until it is erased
+    template<typename ContextType = ServiceContext, size_t Shards = 64, size_t SlabSize = 256>
+    class SessionTable
+    {
+        static_assert(0 < Shards && 0 < SlabSize, "empty session table");
+
+        struct Slot
+        {
+            std::optional<ContextType> ctx;
+            uint64_t id = 0;
+            uint32_t generation = 1;
+            uint32_t next = 0;
+        };
+
+        struct alignas(64) Shard
+        {
+            mutable std::shared_mutex lock;
+            std::vector<std::unique_ptr<Slot[]>> slabs;
+            std::unordered_map<uint64_t, uint32_t> index;
+            uint32_t used = 0;
+            /// free list head, 0 is empty, otherwise slot + 1
+            uint32_t free = 0;
+
+            Slot &              at(uint32_t pos) { return slabs[pos / SlabSize][pos % SlabSize]; }
+            const Slot &        at(uint32_t pos) const { return slabs[pos / SlabSize][pos % SlabSize]; }
+
+            uint32_t            allocate(void)
+            {
+                if(free)
+                {
+                    auto pos = free - 1;
+                    free = at(pos).next;
+                    return pos;
+                }
+
+                if(used == slabs.size() * SlabSize)
+                    slabs.emplace_back(std::make_unique<Slot[]>(SlabSize));
+
+                return used++;
+            }
+
+            void                release(uint32_t pos)
+            {
+                auto & slot = at(pos);
+
+                index.erase(slot.id);
+                slot.ctx.reset();
+                slot.next = free;
+                free = pos + 1;
+
+                // skip 0, the invalid handle
+                if(0 == ++slot.generation)
+                    slot.generation = 1;
+            }
+
+            bool                valid(const SessionHandle & h) const
+            {
+                auto pos = h.slot / Shards;
+
+                if(! h || used <= pos)
+                    return false;
+
+                auto & slot = at(pos);
+                return slot.generation == h.generation && slot.ctx;
+            }
+        };
+
+        std::array<Shard, Shards> shards;
+
+        static size_t           shardOf(uint64_t id)
+        {
+            // fibonacci hash, sequential ids land on different shards
+            return (id * 0x9E3779B97F4A7C15ull >> 32) % Shards;
+        }
+
+        static SessionHandle    handleOf(size_t shard, uint32_t pos, const Slot & slot)
+        {
+            return SessionHandle{ static_cast<uint32_t>(pos * Shards + shard), slot.generation };
+        }
+
+        size_t                  sweepShard(Shard & shard, const std::chrono::seconds & margin)
+        {
+            const std::unique_lock guard{ shard.lock };
+            size_t res = 0;
+
+            for(uint32_t pos = 0; pos < shard.used; ++pos)
+            {
+                auto & slot = shard.at(pos);
+
+                if(slot.ctx && slot.ctx->expiresSoon(margin))
+                {
+                    shard.release(pos);
+                    res++;
+                }
+            }
+
+            return res;
+        }
+
+    public:
+        SessionTable() = default;
+
+        SessionTable(const SessionTable &) = delete;
+        SessionTable & operator= (const SessionTable &) = delete;
+
+        /// store the context under the id, a previous session with the same id is erased
+        SessionHandle insert(uint64_t id, ContextType && ctx)
+        {
+            auto num = shardOf(id);
+            auto & shard = shards[num];
+            const std::unique_lock guard{ shard.lock };
+
+            if(auto it = shard.index.find(id); it != shard.index.end())
+                shard.release(it->second);
+
+            auto pos = shard.allocate();
+            auto & slot = shard.at(pos);
+
+            slot.ctx.emplace(std::move(ctx));
+            slot.id = id;
+            shard.index.emplace(id, pos);
+
+            return handleOf(num, pos, slot);
+        }
+
+        /// handle of the id, empty when not found
+        SessionHandle find(uint64_t id) const
+        {
+            auto num = shardOf(id);
+            auto & shard = shards[num];
+            const std::shared_lock guard{ shard.lock };
+
+            auto it = shard.index.find(id);
+            return it != shard.index.end() ? handleOf(num, it->second, shard.at(it->second)) : SessionHandle{};
+        }
+
+        bool contains(const SessionHandle & h) const
+        {
+            auto & shard = shards[h.slot % Shards];
+            const std::shared_lock guard{ shard.lock };
+
+            return shard.valid(h);
+        }
+
+        /// call func(ContextType &) under the shared shard lock, false for a stale handle;
+        /// lookups in the shard run in parallel, the caller keeps one user per context as for Context itself
+        template<typename Func>
+        bool visit(const SessionHandle & h, Func && func)
+        {
+            auto & shard = shards[h.slot % Shards];
+            const std::shared_lock guard{ shard.lock };
+
+            if(! shard.valid(h))
+                return false;
+
+            func(*shard.at(h.slot / Shards).ctx);
+            return true;
+        }
+
+        bool erase(const SessionHandle & h)
+        {
+            auto & shard = shards[h.slot % Shards];
+            const std::unique_lock guard{ shard.lock };
+
+            if(! shard.valid(h))
+                return false;
+
+            shard.release(h.slot / Shards);
+            return true;
+        }
+
+        bool erase(uint64_t id)
+        {
+            auto & shard = shards[shardOf(id)];
+            const std::unique_lock guard{ shard.lock };
+
+            auto it = shard.index.find(id);
+
+            if(it == shard.index.end())
+                return false;
+
+            shard.release(it->second);
+            return true;
+        }
+
+        /// erase the sessions whose cached lifetime ends within margin, return the count;
+        /// each shard is locked on its own, workers may sweep disjoint shard ranges in parallel
+        size_t sweep(const std::chrono::seconds & margin = std::chrono::seconds(0), size_t first = 0, size_t last = Shards)
+        {
+            size_t res = 0;
+
+            for(size_t it = first; it < last && it < Shards; ++it)
+                res += sweepShard(shards[it], margin);
+
+            return res;
+        }
+
+        size_t size(void) const
+        {
+            size_t res = 0;
+
+            for(auto & shard : shards)
+            {
+                const std::shared_lock guard{ shard.lock };
+                res += shard.index.size();
+            }
+
+            return res;
+        }
+
+        static constexpr size_t shardCount(void) { return Shards; }
+    };
+}
+
+#endif
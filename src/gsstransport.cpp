@@ -0,0 +1,203 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include "gsstransport.h"
+
+namespace Gss
+{
+    TokenTransport::TokenTransport(int sock, size_t maxtok) : maxToken(maxtok), fd(sock)
+    {
+    }
+
+    void TokenTransport::waitEvent(short events) const
+    {
+        struct pollfd pfd = { fd, events, 0 };
+
+        while(0 > poll(& pfd, 1, -1))
+        {
+            if(errno != EINTR)
+                throw std::runtime_error("transport poll");
+        }
+    }
+
+    void TokenTransport::sendToken(const void* buf, size_t len)
+    {
+        uint8_t hdr[4] = { uint8_t(len >> 24), uint8_t(len >> 16), uint8_t(len >> 8), uint8_t(len) };
+        struct iovec iov[2] = { { hdr, sizeof(hdr) }, { (void*) buf, len } };
+
+        struct msghdr msg;
+        memset(& msg, 0, sizeof(msg));
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        while(msg.msg_iovlen)
+        {
+            auto res = sendmsg(fd, & msg, MSG_NOSIGNAL);
+
+            if(0 > res)
+            {
+                if(errno == EINTR)
+                    continue;
+
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    waitEvent(POLLOUT);
+                    continue;
+                }
+
+                throw std::runtime_error("transport send");
+            }
+
+            // skip the sent part
+            while(msg.msg_iovlen && msg.msg_iov->iov_len <= size_t(res))
+            {
+                res -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+
+            if(msg.msg_iovlen)
+            {
+                msg.msg_iov->iov_base = (uint8_t*) msg.msg_iov->iov_base + res;
+                msg.msg_iov->iov_len -= res;
+            }
+        }
+    }
+
+    size_t TokenTransport::pendingSize(void) const
+    {
+        if(rend - rpos < 4)
+            return 4;
+
+        auto ptr = rbuf.data() + rpos;
+        return 4 + ((size_t(ptr[0]) << 24) | (size_t(ptr[1]) << 16) | (size_t(ptr[2]) << 8) | size_t(ptr[3]));
+    }
+
+    ssize_t TokenTransport::fill(void)
+    {
+        auto need = pendingSize();
+
+        if(maxToken + 4 < need)
+            throw std::runtime_error("transport token size");
+
+        // the last token is consumed: drop a buffer grown by a large token, an idle connection keeps at most idleBufferSize
+        if(rpos == rend && rbuf.size() > idleBufferSize)
+            std::vector<uint8_t>().swap(rbuf);
+
+        // allocated on the first read, move the unread part to the front, grow only for a large token
+        if(rbuf.size() - rend < 4096 || rbuf.size() - rpos < need)
+        {
+            if(rpos)
+            {
+                std::memmove(rbuf.data(), rbuf.data() + rpos, rend - rpos);
+                rend -= rpos;
+                rpos = 0;
+            }
+
+            auto sz = std::max(need, rend + 4096);
+
+            if(rbuf.size() < sz)
+                rbuf.resize(sz);
+        }
+
+        while(true)
+        {
+            auto len = recv(fd, rbuf.data() + rend, rbuf.size() - rend, 0);
+
+            if(0 <= len)
+            {
+                rend += len;
+                return len;
+            }
+
+            if(errno == EINTR)
+                continue;
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return -1;
+
+            throw std::runtime_error("transport recv");
+        }
+    }
+
+    bool TokenTransport::nextToken(const uint8_t* & data, size_t & len)
+    {
+        auto need = pendingSize();
+
+        if(maxToken + 4 < need)
+            throw std::runtime_error("transport token size");
+
+        if(rend - rpos < need)
+            return false;
+
+        data = rbuf.data() + rpos + 4;
+        len = need - 4;
+        rpos += need;
+
+        if(rpos == rend)
+            rpos = rend = 0;
+
+        return true;
+    }
+
+    void TokenTransport::waitToken(const uint8_t* & data, size_t & len)
+    {
+        while(! nextToken(data, len))
+        {
+            auto res = fill();
+
+            if(res == 0)
+                throw std::runtime_error("transport eof");
+
+            if(0 > res)
+                waitEvent(POLLIN);
+        }
+    }
+
+    std::vector<uint8_t> TokenTransport::recvToken(void)
+    {
+        const uint8_t* data = nullptr;
+        size_t len = 0;
+
+        waitToken(data, len);
+        return std::vector<uint8_t>(data, data + len);
+    }
+
+    void TokenTransport::recvToken(std::pmr::vector<uint8_t> & buf)
+    {
+        const uint8_t* data = nullptr;
+        size_t len = 0;
+
+        waitToken(data, len);
+        buf.assign(data, data + len);
+    }
+}
@@ -0,0 +1,71 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _GSS_TRANSPORT_
+#define _GSS_TRANSPORT_
+
+#include <sys/types.h>
+
+#include <vector>
+#include <cstdint>
+#include <memory_resource>
+
+namespace Gss
+{
+    /// TokenTransport: framed [len BE32][token] transport over a socket
+    /// the length prefix and the payload go out in one sendmsg, the receive buffer is reused and may hold several tokens;
+    /// partial reads and writes are resumed, a non-blocking socket is waited with poll in the blocking functions
+    class TokenTransport
+    {
+        /// receive buffer kept between tokens, the first fill() allocates 4K and a large token grows it
+        static constexpr size_t idleBufferSize = 64 * 1024;
+
+        std::vector<uint8_t> rbuf;
+        size_t rpos = 0;
+        size_t rend = 0;
+        size_t maxToken = 0;
+        int fd = -1;
+
+        size_t                  pendingSize(void) const;
+        void                    waitEvent(short) const;
+        void                    waitToken(const uint8_t* &, size_t &);
+
+    public:
+        explicit TokenTransport(int sock = -1, size_t maxtok = 16 * 1024 * 1024);
+
+        void                    setDescriptor(int sock) { fd = sock; }
+        int                     descriptor(void) const { return fd; }
+
+        /// blocking send, throw std::runtime_error on error
+        void                    sendToken(const void*, size_t);
+        /// blocking receive, throw std::runtime_error on error, eof or a token above the limit
+        std::vector<uint8_t>    recvToken(void);
+        /// blocking receive into reused storage
+        void                    recvToken(std::pmr::vector<uint8_t> &);
+
+        /// one read into the buffer: bytes read, 0 on eof, -1 if the socket would block; throw on error
+        ssize_t                 fill(void);
+        /// the next complete token from the buffer, valid until the next fill() or recvToken()
+        bool                    nextToken(const uint8_t* & data, size_t & len);
+    };
+}
+
+#endif
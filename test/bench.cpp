@@ -0,0 +1,493 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <memory_resource>
+
+#include "gsslayer.h"
+#include "gssloopback.h"
+#include "localkdc.h"
+
+#ifdef GSSLAYER_COROUTINES
+#include <deque>
+#include "gsscoro.h"
+#endif
+
+using BenchClock = std::chrono::steady_clock;
+
+typedef Gss::LoopbackContext<Gss::ClientContext> BenchClient;
+typedef Gss::LoopbackContext<Gss::ServiceContext> BenchServer;
+
+/// latency samples of one benchmark case
+class Stats
+{
+    std::vector<double> samples;
+    BenchClock::duration total{ 0 };
+
+public:
+    explicit Stats(size_t count) { samples.reserve(count); }
+
+    void add(const BenchClock::duration & dt)
+    {
+        samples.push_back(std::chrono::duration<double, std::micro>(dt).count());
+        total += dt;
+    }
+
+    double percentile(double pct) const
+    {
+        if(samples.empty())
+            return 0;
+
+        size_t pos = pct * (samples.size() - 1);
+        return samples[pos];
+    }
+
+    void report(const char* op, size_t size, bool encrypt)
+    {
+        std::sort(samples.begin(), samples.end());
+        auto sec = std::chrono::duration<double>(total).count();
+
+        std::cout << std::left << std::setw(16) << op << std::right <<
+            std::setw(10) << size << std::setw(6) << (encrypt ? "yes" : "no") <<
+            std::setw(10) << samples.size() <<
+            std::fixed << std::setprecision(1) <<
+            std::setw(12) << (0 < sec ? samples.size() / sec : 0) <<
+            std::setw(12) << (0 < sec ? size * samples.size() / sec / (1024 * 1024) : 0) <<
+            std::setprecision(2) <<
+            std::setw(10) << percentile(0.50) <<
+            std::setw(10) << percentile(0.99) <<
+            std::setw(10) << percentile(0.999) <<
+            std::setw(12) << percentile(1.0) << std::endl;
+    }
+};
+
+template<typename Func>
+bool measure(Stats & stats, size_t count, const Func & func)
+{
+    for(size_t it = 0; it < count; ++it)
+    {
+        auto start = BenchClock::now();
+
+        if(! func())
+            return false;
+
+        stats.add(BenchClock::now() - start);
+    }
+
+    return true;
+}
+
+/// one token in flight: time the sender and the receiver of each round separately
+template<typename Send, typename Recv>
+bool measure(Stats & send, Stats & recv, size_t count, const Send & sfunc, const Recv & rfunc)
+{
+    for(size_t it = 0; it < count; ++it)
+    {
+        auto start = BenchClock::now();
+
+        if(! sfunc())
+            return false;
+
+        auto middle = BenchClock::now();
+
+        if(! rfunc())
+            return false;
+
+        send.add(middle - start);
+        recv.add(BenchClock::now() - middle);
+    }
+
+    return true;
+}
+
+bool handshake(BenchClient & cli, BenchServer & srv, const std::string & service)
+{
+    std::vector<uint8_t> ctok, stok;
+    auto cst = cli.initStart(service, Gss::NameType::NtHostService, ctok,
+                    GSS_C_MUTUAL_FLAG | GSS_C_REPLAY_FLAG | GSS_C_SEQUENCE_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
+    auto sst = Gss::HandshakeStatus::Continue;
+
+    while(cst != Gss::HandshakeStatus::Failed)
+    {
+        if(ctok.empty())
+            return cst == Gss::HandshakeStatus::Complete && sst == Gss::HandshakeStatus::Complete;
+
+        sst = srv.acceptStep(ctok.data(), ctok.size(), stok);
+
+        if(sst == Gss::HandshakeStatus::Failed)
+            return false;
+
+        if(stok.empty())
+            return cst == Gss::HandshakeStatus::Complete && sst == Gss::HandshakeStatus::Complete;
+
+        cst = cli.initStep(stok.data(), stok.size(), ctok);
+    }
+
+    return false;
+}
+
+#ifdef GSSLAYER_COROUTINES
+/// single-threaded event loop of the coroutine case: resumes the ready handles in order
+class CoroLoop
+{
+    std::deque<std::coroutine_handle<>> ready;
+
+public:
+    void post(std::coroutine_handle<> handle) { ready.push_back(handle); }
+
+    void run(void)
+    {
+        while(! ready.empty())
+        {
+            auto handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+        }
+    }
+};
+
+/// one direction of the in-memory async transport, the receiver suspends while it is empty
+struct CoroPipe
+{
+    std::deque<std::vector<uint8_t>> tokens;
+    std::coroutine_handle<> waiter;
+};
+
+struct CoroRecvAwaiter
+{
+    CoroPipe & pipe;
+
+    bool await_ready(void) const { return ! pipe.tokens.empty(); }
+    void await_suspend(std::coroutine_handle<> handle) { pipe.waiter = handle; }
+
+    std::vector<uint8_t> await_resume(void)
+    {
+        auto res = std::move(pipe.tokens.front());
+        pipe.tokens.pop_front();
+        return res;
+    }
+};
+
+/// a send yields to the loop once, as a socket write waiting for readiness
+struct CoroYield
+{
+    CoroLoop & loop;
+
+    bool await_ready(void) const { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { loop.post(handle); }
+    void await_resume(void) const {}
+};
+
+template<typename AsyncBase>
+class CoroEndpoint : public AsyncBase
+{
+    CoroLoop & loop;
+    CoroPipe & in;
+    CoroPipe & out;
+
+public:
+    CoroEndpoint(CoroLoop & lp, CoroPipe & pin, CoroPipe & pout) : loop(lp), in(pin), out(pout) {}
+
+    // AsyncContext override
+    Gss::Task<std::vector<uint8_t>> asyncRecvToken(void) override
+    {
+        co_return co_await CoroRecvAwaiter{ in };
+    }
+
+    Gss::Task<void> asyncSendToken(const void* buf, size_t len) override
+    {
+        co_await CoroYield{ loop };
+        out.tokens.emplace_back((const uint8_t*) buf, (const uint8_t*) buf + len);
+
+        if(out.waiter)
+            loop.post(std::exchange(out.waiter, nullptr));
+    }
+};
+
+/// async handshake, then one message and one MIC per round, both peers as coroutines on one loop
+bool measureCoro(Stats & stats, size_t count, size_t size, const std::string & service)
+{
+    CoroLoop loop;
+    CoroPipe c2s, s2c;
+    CoroEndpoint<Gss::AsyncClientContext> cli(loop, s2c, c2s);
+    CoroEndpoint<Gss::AsyncServiceContext> srv(loop, c2s, s2c);
+
+    if(! srv.acquireCredential(service, Gss::NameType::NtHostService, Gss::CredentialUsage::Accept, true /* cached */))
+        return false;
+
+    std::vector<uint8_t> msg(size, 0x5A);
+    std::vector<uint8_t> buf;
+
+    auto server = [&]() -> Gss::Task<bool>
+    {
+        if(! co_await srv.asyncAcceptClient())
+            co_return false;
+
+        for(size_t it = 0; it < count; ++it)
+        {
+            if(! co_await srv.asyncRecvMessage(buf) || buf != msg ||
+                ! co_await srv.asyncSendMIC(buf.data(), buf.size()))
+                co_return false;
+        }
+
+        co_return true;
+    };
+
+    auto client = [&]() -> Gss::Task<bool>
+    {
+        if(! co_await cli.asyncInitConnect(service, Gss::NameType::NtHostService,
+                    GSS_C_MUTUAL_FLAG | GSS_C_REPLAY_FLAG | GSS_C_SEQUENCE_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG))
+            co_return false;
+
+        for(size_t it = 0; it < count; ++it)
+        {
+            auto start = BenchClock::now();
+
+            if(! co_await cli.asyncSendMessage(msg.data(), msg.size()) ||
+                ! co_await cli.asyncRecvMIC(msg.data(), msg.size()))
+                co_return false;
+
+            stats.add(BenchClock::now() - start);
+        }
+
+        co_return true;
+    };
+
+    auto stask = server();
+    auto ctask = client();
+
+    stask.start();
+    ctask.start();
+    loop.run();
+
+    return stask.done() && ctask.done() && stask.result() && ctask.result();
+}
+#endif
+
+/// library counters, built with GSSLAYER_METRICS
+void printMetrics(const Gss::MetricsSnapshot & snap)
+{
+    std::cout << std::endl << std::left << std::setw(24) << "gss call" << std::right << std::setw(10) << "calls" << std::setw(8) << "errors" <<
+        std::setw(14) << "MB in" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::endl;
+
+    for(size_t it = 0; it < snap.ops.size(); ++it)
+    {
+        auto op = static_cast<Gss::MetricOp>(it);
+        auto & val = snap[op];
+
+        if(val.calls == 0)
+            continue;
+
+        std::cout << std::left << std::setw(24) << Gss::metricName(op) << std::right << std::setw(10) << val.calls << std::setw(8) << val.errors <<
+            std::setw(14) << std::fixed << std::setprecision(1) << val.bytes / 1048576.0 <<
+            std::setw(10) << val.percentile(0.5) / 1000.0 << std::setw(10) << val.percentile(0.99) / 1000.0 << std::endl;
+    }
+
+    std::cout << "handshakes: " << snap.handshakes << ", failures: " << snap.handshakeFailures << ", rounds: " << snap.handshakeRounds << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string service = "bench@localhost";
+    size_t iterations = 10000;
+    size_t maxsize = 16 * 1024 * 1024;
+    bool kdc = true;
+
+    for(int it = 1; it < argc; ++it)
+    {
+        if(0 == std::strcmp(argv[it], "--iterations") && it + 1 < argc)
+        {
+            iterations = std::stoul(argv[it + 1]);
+            it = it + 1;
+        }
+        else
+        if(0 == std::strcmp(argv[it], "--max-size") && it + 1 < argc)
+        {
+            maxsize = std::stoul(argv[it + 1]);
+            it = it + 1;
+        }
+        else
+        if(0 == std::strcmp(argv[it], "--service") && it + 1 < argc)
+        {
+            service.assign(argv[it + 1]);
+            it = it + 1;
+        }
+        else
+        if(0 == std::strcmp(argv[it], "--no-kdc"))
+        {
+            kdc = false;
+        }
+        else
+        {
+            std::cout << "usage: " << argv[0] << " --iterations " << iterations << " --max-size " << maxsize << " [--service <" << service << ">" << " --no-kdc]" << std::endl;
+            return 0;
+        }
+    }
+
+    LocalKdc local;
+
+    if(kdc && ! local.start(service))
+        return -1;
+
+    // same thread: the ring must hold the largest token
+    auto [cliep, srvep] = Gss::makeLoopback(2 * maxsize + 4096);
+    BenchClient cli(std::move(cliep));
+    BenchServer srv(std::move(srvep));
+
+    if(! srv.acquireCredential(service, Gss::NameType::NtHostService, Gss::CredentialUsage::Accept, true /* cached */))
+        return -1;
+
+    std::cout << std::left << std::setw(16) << "operation" << std::right << std::setw(10) << "size" << std::setw(6) << "enc" <<
+        std::setw(10) << "ops" << std::setw(12) << "ops/s" << std::setw(12) << "MB/s" <<
+        std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(10) << "p99.9 us" << std::setw(12) << "max us" << std::endl;
+
+    std::pmr::unsynchronized_pool_resource pool;
+    std::pmr::vector<uint8_t> plain(& pool);
+
+    srv.setMemoryResource(& pool);
+
+    try
+    {
+        size_t count = std::max<size_t>(1, iterations / 10);
+        Stats names(iterations);
+
+        if(! measure(names, iterations, [&]{ return bool(Gss::importName(service, Gss::NameType::NtHostService)); }))
+            return -1;
+
+        names.report("importName", service.size(), false);
+
+        Stats hands(count);
+
+        if(! measure(hands, count, [&]{ return handshake(cli, srv, service); }))
+            return -1;
+
+        hands.report("handshake", 0, false);
+
+        for(size_t size = 16; size <= maxsize; size *= 16)
+        {
+            std::vector<uint8_t> msg(size, 0x5A);
+            // bound the bytes moved per case
+            count = std::max<size_t>(16, std::min<size_t>(iterations, (size_t(256) << 20) / size));
+
+            for(bool encrypt : { false, true })
+            {
+                Stats send(count), recv(count);
+
+                if(! measure(send, recv, count, [&]{ return cli.sendMessage(msg.data(), msg.size(), encrypt); },
+                                                [&]{ return srv.recvMessage().size() == size; }))
+                    return -1;
+
+                send.report("sendMessage", size, encrypt);
+                recv.report("recvMessage", size, encrypt);
+
+                // reused pool storage, in place unwrap
+                Stats pmrsend(count), pmrrecv(count);
+
+                if(! measure(pmrsend, pmrrecv, count, [&]{ return cli.sendMessage(msg.data(), msg.size(), encrypt); },
+                                                [&]{ return srv.recvMessage(plain) && plain.size() == size; }))
+                    return -1;
+
+                pmrrecv.report("recvMessage/pmr", size, encrypt);
+
+                // frame mode, fragments of 16K tokens
+                Stats fsend(count), frecv(count);
+                cli.setFrameSize(16384);
+                srv.setFrameSize(16384);
+
+                bool framed = measure(fsend, frecv, count, [&]{ return cli.sendMessage(msg.data(), msg.size(), encrypt); },
+                                                [&]{ return srv.recvMessage().size() == size; });
+
+                cli.setFrameSize(0);
+                srv.setFrameSize(0);
+
+                if(! framed)
+                    return -1;
+
+                fsend.report("sendMessage/16K", size, encrypt);
+                frecv.report("recvMessage/16K", size, encrypt);
+            }
+
+            Stats send(count), recv(count);
+
+            if(! measure(send, recv, count, [&]{ return srv.sendMIC(msg.data(), msg.size()); },
+                                            [&]{ return cli.recvMIC(msg.data(), msg.size()); }))
+                return -1;
+
+            send.report("sendMIC", size, false);
+            recv.report("recvMIC", size, false);
+        }
+
+        // small messages: one sendMessage per message against 64 messages per BatchWriter token
+        std::vector<uint8_t> small(64, 0x5A);
+        Gss::BatchWriter writer(cli, 64 * (4 + small.size()) + 4);
+        Gss::BatchReader reader(srv);
+        count = iterations;
+        Stats bsend(count), brecv(count);
+
+        if(! measure(bsend, brecv, count, [&]
+            {
+                for(int it = 0; it < 64; ++it)
+                    if(! writer.write(small.data(), small.size()))
+                        return false;
+                return bool(writer.flush());
+            },
+            [&]
+            {
+                Gss::BufferView msg;
+                for(int it = 0; it < 64; ++it)
+                    if(! reader.read(msg) || msg.size != small.size())
+                        return false;
+                return true;
+            }))
+            return -1;
+
+        bsend.report("BatchWriter/64", 64 * small.size(), true);
+        brecv.report("BatchReader/64", 64 * small.size(), true);
+
+#ifdef GSSLAYER_COROUTINES
+        // message + MIC round trip over an awaitable transport which suspends every send and every empty receive
+        for(size_t size : { size_t(16), size_t(4096) })
+        {
+            Stats coro(iterations);
+
+            if(! measureCoro(coro, iterations, size, service))
+                return -1;
+
+            coro.report("async msg+MIC", size, true);
+        }
+#endif
+
+        if(Gss::metricsEnabled())
+            printMetrics(Gss::metricsSnapshot());
+    }
+    catch(const std::exception & err)
+    {
+        std::cerr << "exception: " << err.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
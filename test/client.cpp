@@ -23,11 +23,12 @@
 #include <iostream>
 
 #include "gsslayer.h"
+#include "gsstransport.h"
 #include "tools.h"
 
 class GssApiClient : public Gss::ClientContext
 {
-    int sock = 0;
+    Gss::TokenTransport transport;
 
 public:
     GssApiClient() = default;
@@ -35,26 +36,33 @@ public:
     // ServiceContext override
     std::vector<uint8_t> recvToken(void) override
     {
-        auto len = TCPSocket::readIntBE32(sock);
-        std::cout << "token recv: " << len << std::endl;
-        return TCPSocket::readData(sock, len);
+        auto buf = transport.recvToken();
+        std::cout << "token recv: " << buf.size() << std::endl;
+        return buf;
+    }
+
+    // ServiceContext override
+    bool recvTokenInto(std::pmr::vector<uint8_t> & buf) override
+    {
+        transport.recvToken(buf);
+        std::cout << "token recv: " << buf.size() << std::endl;
+        return true;
     }
 
     // ServiceContext override
     void sendToken(const void* buf, size_t len) override
     {
         std::cout << "token send: " << len << std::endl;
-        TCPSocket::writeIntBE32(sock, len);
-        TCPSocket::writeData(sock, buf, len);
+        transport.sendToken(buf, len);
     }
 
     // ServiceContext override
     void error(const char* func, const char* subfunc, OM_uint32 code1, OM_uint32 code2) const override
     {
-        std::cerr << func << ": " << subfunc << " failed, " << Gss::error2str(code1, code2) << std::endl;
+        // the failures are printed from the returned Result
     }
 
-    int start(std::string_view ipaddr, int port, std::string_view service, bool mutual, const std::vector<char> & buf)
+    int start(std::string_view ipaddr, int port, std::string_view service, bool mutual, const Gss::ChannelBindings & cb, const std::vector<char> & buf)
     {
         std::cout << "service id: " << service.data() << std::endl;
 
@@ -66,39 +74,49 @@ public:
         //if(! acquireCredential("username", Gss::NameType::NtUserName, Gss::CredentialUsage::Initiate))
         //    return -1;
 
-        sock = TCPSocket::connect(ipaddr, port);
+        int sock = TCPSocket::connect(ipaddr, port);
         std::cout << "sock fd: " << sock << std::endl;
 
-        if(! initConnect(service, Gss::NameType::NtHostService, flag))
+        transport.setDescriptor(sock);
+
+        if(auto res = initConnect(service, Gss::NameType::NtHostService, cb, flag); ! res)
+        {
+            std::cerr << "init connect: " << res.func() << " failed, " << res.message() << std::endl;
             return -1;
+        }
 
         // client info
         // std::string name1 = Gss::exportName(srcName());
         // std::cout << "service id: " << name1 << std::endl;
 
         // mech types
-        auto names = mechNames();
-        auto mech = Gss::exportOID(mechTypes());
+        auto & names = mechNames();
 
-        std::cout << "mechanism " << mech << " supports " << names.size() << " names" << std::endl;
+        std::cout << "mechanism " << Gss::Oid(mechTypes()) << " supports " << names.size() << " names" << std::endl;
 
-        for(auto & name : mechNames())
+        for(auto & name : names)
         {
             std::cout << " - mech name: " << name << std::endl;
         }
 
         // flags
-        for(auto & f : Gss::exportFlags(supportFlags()))
+        for(auto f : Gss::exportFlags(supportFlags()))
         {
             std::cout << "supported flag: " << flagName(f) << std::endl;
         }
 
-        bool res = sendMessage(buf.data(), buf.size(), true /* encrypt */);
+        auto res = sendMessage(buf.data(), buf.size(), true /* encrypt */);
         std::cout << "send data: " << (res ? "success" : "failed") << std::endl;
 
+        if(! res)
+            std::cerr << res.func() << " failed, " << res.message() << std::endl;
+
         res = recvMIC(buf.data(), buf.size());
         std::cout << "recv mic: " << (res ? "verified" : "failed") << std::endl;
 
+        if(! res)
+            std::cerr << res.func() << " failed, " << res.message() << std::endl;
+
         return 0;
     }
 };
@@ -111,6 +129,8 @@ int main(int argc, char **argv)
     std::vector<char> msg { '1', '2', '3', '4', '5', '6', '7', '8', '9', '0' };
     std::string service = "TestService";
     bool mutual = false;
+    Gss::ChannelBindings bindings;
+    Gss::Mechanism mech = Gss::Mechanism::Default;
 
     for(int it = 1; it < argc; ++it)
     {
@@ -152,15 +172,35 @@ int main(int argc, char **argv)
             mutual = true;
         }
         else
+        if(0 == std::strcmp(argv[it], "--channel-binding") && it + 1 < argc)
+        {
+            bindings = Gss::ChannelBindings(argv[it + 1], strlen(argv[it + 1]));
+            it = it + 1;
+        }
+        else
+        if(0 == std::strcmp(argv[it], "--mech") && it + 1 < argc)
+        {
+            if(0 == std::strcmp(argv[it + 1], "krb5"))
+                mech = Gss::Mechanism::Krb5;
+            else
+            if(0 == std::strcmp(argv[it + 1], "spnego"))
+                mech = Gss::Mechanism::Spnego;
+            else
+                std::cerr << "unknown mechanism" << std::endl;
+            it = it + 1;
+        }
+        else
         {
-            std::cout << "usage: " << argv[0] << " --ipaddr 127.0.0.1" << " --port 44444" << " --service <" << service << ">" << " [--mutual]" << " --message 1234567890" << std::endl;
+            std::cout << "usage: " << argv[0] << " --ipaddr 127.0.0.1" << " --port 44444" << " --service <" << service << ">" << " [--mutual]" << " [--channel-binding data]" << " [--mech krb5|spnego]" << " --message 1234567890" << std::endl;
             return 0;
         }
     }
 
     try
     {
-        res = GssApiClient().start(ipaddr, port, service, mutual, msg);
+        GssApiClient client;
+        client.setMechanism(mech);
+        res = client.start(ipaddr, port, service, mutual, bindings, msg);
     }
     catch(const std::exception & err)
     {
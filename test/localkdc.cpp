@@ -0,0 +1,164 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "localkdc.h"
+
+int LocalKdc::freePort(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    memset(& addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bind(fd, (struct sockaddr*) & addr, sizeof(addr));
+    getsockname(fd, (struct sockaddr*) & addr, & len);
+    close(fd);
+
+    return ntohs(addr.sin_port);
+}
+
+bool LocalKdc::run(const std::string & cmd) const
+{
+    auto line = "PATH=\"$PATH:/usr/sbin:/usr/local/sbin\" " + cmd + " >> " + dir + "/setup.log 2>&1";
+    return 0 == std::system(line.c_str());
+}
+
+bool LocalKdc::waitPort(void) const
+{
+    for(int it = 0; it < 100; ++it)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+
+        memset(& addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        bool res = 0 == connect(fd, (struct sockaddr*) & addr, sizeof(addr));
+        close(fd);
+
+        if(res)
+            return true;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    return false;
+}
+
+LocalKdc::~LocalKdc()
+{
+    if(0 < kdc)
+    {
+        kill(kdc, SIGTERM);
+        waitpid(kdc, nullptr, 0);
+    }
+
+    if(dir.size())
+        std::system(("rm -rf " + dir).c_str());
+}
+
+bool LocalKdc::start(const std::string & service)
+{
+    char tmpl[] = "/tmp/gsslayer-kdc-XXXXXX";
+
+    if(! mkdtemp(tmpl))
+        return false;
+
+    dir.assign(tmpl);
+    port = freePort();
+
+    std::ofstream(dir + "/krb5.conf") <<
+        "[libdefaults]\n"
+        "  default_realm = " << realm << "\n"
+        "  dns_lookup_kdc = false\n"
+        "  dns_lookup_realm = false\n"
+        "  dns_canonicalize_hostname = false\n"
+        "  rdns = false\n"
+        "[realms]\n"
+        "  " << realm << " = {\n"
+        "    kdc = tcp/127.0.0.1:" << port << "\n"
+        "  }\n"
+        "[domain_realm]\n"
+        "  localhost = " << realm << "\n";
+
+    std::ofstream(dir + "/kdc.conf") <<
+        "[realms]\n"
+        "  " << realm << " = {\n"
+        "    database_name = " << dir << "/principal\n"
+        "    key_stash_file = " << dir << "/stash\n"
+        "    kdc_listen = " << port << "\n"
+        "    kdc_tcp_listen = " << port << "\n"
+        "  }\n"
+        "[logging]\n"
+        "  kdc = FILE:" << dir << "/kdc.log\n";
+
+    setenv("KRB5_CONFIG", (dir + "/krb5.conf").c_str(), 1);
+    setenv("KRB5_KDC_PROFILE", (dir + "/kdc.conf").c_str(), 1);
+    setenv("KRB5_KTNAME", ("FILE:" + dir + "/service.keytab").c_str(), 1);
+    setenv("KRB5CCNAME", ("FILE:" + dir + "/ccache").c_str(), 1);
+
+    auto princ = service.substr(0, service.find('@')) + "/localhost";
+
+    if(! run("kdb5_util create -s -r " + realm + " -P bench-master-key") ||
+        ! run("kadmin.local -r " + realm + " -q \"addprinc -randkey " + princ + "\"") ||
+        ! run("kadmin.local -r " + realm + " -q \"ktadd -k " + dir + "/service.keytab " + princ + "\"") ||
+        ! run("kadmin.local -r " + realm + " -q \"addprinc -randkey bench\"") ||
+        ! run("kadmin.local -r " + realm + " -q \"ktadd -k " + dir + "/client.keytab bench\""))
+    {
+        std::cerr << "kdc setup failed, see: " << dir << "/setup.log" << std::endl;
+        return false;
+    }
+
+    kdc = fork();
+
+    if(kdc == 0)
+    {
+        execlp("sh", "sh", "-c", ("PATH=\"$PATH:/usr/sbin:/usr/local/sbin\" exec krb5kdc -n -r " + realm).c_str(), nullptr);
+        _exit(1);
+    }
+
+    if(kdc < 0 || ! waitPort())
+    {
+        std::cerr << "krb5kdc start failed" << std::endl;
+        return false;
+    }
+
+    return run("kinit -k -t " + dir + "/client.keytab bench@" + realm);
+}
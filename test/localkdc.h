@@ -0,0 +1,52 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef _LOCAL_KDC_
+#define _LOCAL_KDC_
+
+#include <string>
+#include <sys/types.h>
+
+/// throwaway local KDC with a service and a client keytab, shared by the bench and the stress test
+class LocalKdc
+{
+    std::string dir;
+    std::string realm = "BENCH.LOCAL";
+    pid_t kdc = -1;
+    int port = 0;
+
+    static int freePort(void);
+    bool run(const std::string & cmd) const;
+    bool waitPort(void) const;
+
+public:
+    LocalKdc() = default;
+    ~LocalKdc();
+
+    LocalKdc(const LocalKdc &) = delete;
+    LocalKdc & operator= (const LocalKdc &) = delete;
+
+    /// create the realm, the service@localhost and the client principals, start krb5kdc and kinit the client;
+    /// KRB5_CONFIG, KRB5_KTNAME and KRB5CCNAME of the process point to the new realm
+    bool start(const std::string & service);
+};
+
+#endif
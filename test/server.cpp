@@ -19,14 +19,26 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <chrono>
+#include <thread>
 #include <sstream>
+#include <cerrno>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <unordered_map>
 
 #include "gsslayer.h"
+#include "gsstransport.h"
 #include "tools.h"
 
+std::mutex outputLock;
+
 std::string buffer2hexstring(const uint8_t* data, size_t length, std::string_view sep = ",", bool prefix = true)
 {
     std::ostringstream os;
@@ -40,77 +52,373 @@ std::string buffer2hexstring(const uint8_t* data, size_t length, std::string_vie
     return os.str();
 }
 
-class GssApiServer : public Gss::ServiceContext
+/// one client: non-blocking socket, framed [len BE32][token] buffers and the ServiceContext state
+class GssApiConnection : public Gss::ServiceContext
 {
-    int sock = 0;
+    int sock = -1;
+    bool verbose = true;
+    bool wantWrite = false;
+
+    Gss::TokenTransport transport;
+    std::vector<uint8_t> wbuf;
+    std::vector<uint8_t> token;
+    std::vector<uint8_t> hsout;
+    size_t wpos = 0;
+
+    void printClientInfo(void)
+    {
+        // interned once per principal, the authorization and the rate limits may key on the id
+        auto id = srcNameId();
+
+        std::ostringstream os;
+        os << "sock fd: " << sock << ", client id: " << Gss::NameCache::instance().displayName(id) << " (#" << id << ")" << std::endl;
+        os << "context lifetime: " << lifetimeLeft().count() << " sec" << std::endl;
+
+        // mech types
+        auto & names = mechNames();
+        os << "mechanism " << Gss::Oid(mechTypes()) << " supports " << names.size() << " names" << std::endl;
+
+        for(auto & name : names)
+        {
+            os << " - mech name: " << name << std::endl;
+        }
+
+        // flags
+        for(auto f : Gss::exportFlags(supportFlags()))
+        {
+            os << "supported flag: " << flagName(f) << std::endl;
+        }
+
+        const std::scoped_lock guard{ outputLock };
+        std::cout << os.str();
+    }
+
+    bool processToken(const uint8_t* buf, size_t len)
+    {
+        if(! isEstablished())
+        {
+            auto status = acceptStep(buf, len, hsout);
+
+            if(hsout.size())
+                sendToken(hsout.data(), hsout.size());
+
+            if(status == Gss::HandshakeStatus::Complete && verbose)
+                printClientInfo();
+
+            return status != Gss::HandshakeStatus::Failed;
+        }
+
+        // recvMessage pulls the token through recvToken
+        token.assign(buf, buf + len);
+        auto msg = recvMessage();
+
+        if(msg.empty())
+            return false;
+
+        auto res = sendMIC(msg.data(), msg.size());
+
+        if(verbose)
+        {
+            const std::scoped_lock guard{ outputLock };
+            std::cout << "sock fd: " << sock << ", recv data: " << buffer2hexstring(msg.data(), msg.size()) << std::endl;
+            std::cout << "sock fd: " << sock << ", send mic: " << (res ? "success" : "failed") << std::endl;
+        }
+
+        return bool(res);
+    }
 
 public:
-    GssApiServer() = default;
+    GssApiConnection(int fd, const Gss::CredentialRef & cred, bool verb) : sock(fd), verbose(verb), transport(fd)
+    {
+        setCredential(cred);
+    }
 
     // ServiceContext override
     std::vector<uint8_t> recvToken(void) override
     {
-        auto len = TCPSocket::readIntBE32(sock);
-        std::cout << "token recv: " << len << std::endl;
-        return TCPSocket::readData(sock, len);
+        return std::move(token);
     }
 
     // ServiceContext override
     void sendToken(const void* buf, size_t len) override
     {
-        std::cout << "token send: " << len << std::endl;
-        TCPSocket::writeIntBE32(sock, len);
-        TCPSocket::writeData(sock, buf, len);
+        auto ptr = (const uint8_t*) buf;
+        uint8_t hdr[4] = { uint8_t(len >> 24), uint8_t(len >> 16), uint8_t(len >> 8), uint8_t(len) };
+
+        wbuf.insert(wbuf.end(), hdr, hdr + 4);
+        wbuf.insert(wbuf.end(), ptr, ptr + len);
     }
 
-    // ServiceContext override
-    void error(const char* func, const char* subfunc, OM_uint32 code1, OM_uint32 code2) const override
+    /// read all available data and process complete tokens, false: close connection
+    bool onReadable(void)
+    {
+        while(true)
+        {
+            ssize_t len = 0;
+
+            try
+            {
+                len = transport.fill();
+            }
+            catch(const std::exception &)
+            {
+                return false;
+            }
+
+            // process the received tokens before eof
+            const uint8_t* data = nullptr;
+            size_t size = 0;
+
+            while(transport.nextToken(data, size))
+            {
+                if(! processToken(data, size))
+                    return false;
+            }
+
+            if(len <= 0)
+                return len < 0;
+        }
+    }
+
+    /// write the pending tokens, false: close connection
+    bool onWritable(void)
     {
-        std::cerr << func << ": " << subfunc << " failed, " << Gss::error2str(code1, code2) << std::endl;
+        while(wpos < wbuf.size())
+        {
+            auto len = ::write(sock, wbuf.data() + wpos, wbuf.size() - wpos);
+
+            if(len < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+
+                return errno == EAGAIN || errno == EWOULDBLOCK;
+            }
+
+            wpos += len;
+        }
+
+        wbuf.clear();
+        wpos = 0;
+
+        return true;
     }
 
-    int start(int port, std::string_view service)
+    bool hasOutput(void) const
     {
-        std::cout << "service id: " << service.data() << std::endl;
+        return wpos < wbuf.size();
+    }
 
-        if(! acquireCredential(service, Gss::NameType::NtHostService))
-            return -1;
+    /// switch EPOLLOUT on while output is pending
+    void updateEvents(int epfd)
+    {
+        if(wantWrite != hasOutput())
+        {
+            wantWrite = hasOutput();
 
-        int srvfd = TCPSocket::listen("any", port);
-        std::cout << "srv fd: " << srvfd << std::endl;
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLRDHUP | (wantWrite ? EPOLLOUT : 0);
+            ev.data.fd = sock;
 
-        sock = TCPSocket::accept(srvfd);
-        std::cout << "sock fd: " << sock << std::endl;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, sock, & ev);
+        }
+    }
+};
 
-        if(! acceptClient())
-            return -1;
+class GssApiServer
+{
+    std::string service;
+    Gss::ChannelBindings bindings;
+    Gss::Mechanism mech = Gss::Mechanism::Default;
+    uint16_t port = 0;
+    bool verbose = true;
 
-        // client info
-        std::string name1 = Gss::exportName(srcName());
-        std::cout << "client id: " << name1 << std::endl;
+    /// listen socket pause after an accept resource error
+    static constexpr std::chrono::milliseconds acceptPause{ 100 };
 
-        // mech types
-        auto names = mechNames();
-        auto mech = Gss::exportOID(mechTypes());
+    void addEvents(int epfd, int fd, uint32_t events) const
+    {
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+
+        if(0 > epoll_ctl(epfd, EPOLL_CTL_ADD, fd, & ev))
+            throw std::runtime_error("epoll add");
+    }
 
-        std::cout << "mechanism " << mech << " supports " << names.size() << " names" << std::endl;
+    /// accept all pending clients, false: out of descriptors or memory, pause the listen socket
+    bool acceptClients(int epfd, int srvfd, std::unordered_map<int, GssApiConnection> & conns) const
+    {
+        while(true)
+        {
+            int sock = ::accept4(srvfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+            if(0 > sock)
+            {
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    return true;
+
+                // the client gave up or a signal came in, try the next one
+                if(errno == EINTR || errno == ECONNABORTED)
+                    continue;
+
+                // EMFILE, ENFILE, ENOBUFS, ENOMEM: the pending client stays queued and would wake epoll again at once
+                const std::scoped_lock guard{ outputLock };
+                std::cerr << "accept: " << std::strerror(errno) << ", pause " << acceptPause.count() << " ms" << std::endl;
+                return false;
+            }
+
+            // the cached credential is shared between all connections and workers
+            Gss::ErrorCodes err;
+            auto cred = Gss::CredentialCache::instance().acquire(service, Gss::NameType::NtHostService, Gss::CredentialUsage::Accept, & err, mech);
+
+            if(! cred)
+            {
+                ::close(sock);
+                continue;
+            }
+
+            auto it = conns.emplace(sock, GssApiConnection(sock, cred, verbose)).first;
+            it->second.setChannelBindings(bindings);
+            addEvents(epfd, sock, EPOLLIN | EPOLLRDHUP);
+        }
+    }
+
+    void worker(void) const
+    {
+        int srvfd = TCPSocket::listen("any", port, SOMAXCONN, true /* reuseport */);
+        TCPSocket::setNonBlocking(srvfd);
+
+        int epfd = epoll_create1(EPOLL_CLOEXEC);
+        if(0 > epfd)
+            throw std::runtime_error("epoll create");
+
+        addEvents(epfd, srvfd, EPOLLIN);
+
+        std::unordered_map<int, GssApiConnection> conns;
+        struct epoll_event events[256];
+        std::chrono::steady_clock::time_point acceptResume;
+        bool acceptPaused = false;
 
-        for(auto & name : mechNames())
+        while(true)
         {
-            std::cout << " - mech name: " << name << std::endl;
+            int timeout = -1;
+
+            if(acceptPaused)
+            {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(acceptResume - std::chrono::steady_clock::now());
+
+                if(left.count() <= 0)
+                {
+                    addEvents(epfd, srvfd, EPOLLIN);
+                    acceptPaused = false;
+                }
+                else
+                {
+                    timeout = left.count();
+                }
+            }
+
+            int nfds = epoll_wait(epfd, events, 256, timeout);
+
+            if(0 > nfds)
+            {
+                if(errno == EINTR)
+                    continue;
+
+                throw std::runtime_error("epoll wait");
+            }
+
+            for(int it = 0; it < nfds; ++it)
+            {
+                int fd = events[it].data.fd;
+
+                if(fd == srvfd)
+                {
+                    // closed connections free descriptors meanwhile, the other clients are still served
+                    if(! acceptPaused && ! acceptClients(epfd, srvfd, conns))
+                    {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, srvfd, nullptr);
+                        acceptResume = std::chrono::steady_clock::now() + acceptPause;
+                        acceptPaused = true;
+                    }
+
+                    continue;
+                }
+
+                auto conn = conns.find(fd);
+                if(conn == conns.end())
+                    continue;
+
+                bool alive = ! (events[it].events & EPOLLERR);
+
+                if(alive && (events[it].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+                    alive = conn->second.onReadable();
+
+                // flush the last tokens also before close
+                if(conn->second.hasOutput() && ! conn->second.onWritable())
+                    alive = false;
+
+                if(alive)
+                {
+                    conn->second.updateEvents(epfd);
+                }
+                else
+                {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                    ::close(fd);
+                    conns.erase(conn);
+                }
+            }
         }
+    }
 
-        // flags
-        for(auto & f : Gss::exportFlags(supportFlags()))
+public:
+    GssApiServer(std::string_view srv, const Gss::ChannelBindings & cb, const Gss::Mechanism & mt, uint16_t num, bool verb) : service(srv), bindings(cb), mech(mt), port(num), verbose(verb) {}
+
+    int start(size_t threads)
+    {
+        std::cout << "service id: " << service << std::endl;
+
+        // mechanism metadata for mechNames(), inquired before the first handshake
+        Gss::MechanismCache::instance();
+        Gss::ErrorCodes err;
+
+        if(! Gss::CredentialCache::instance().acquire(service, Gss::NameType::NtHostService, Gss::CredentialUsage::Accept, & err, mech))
         {
-            std::cout << "supported flag: " << flagName(f) << std::endl;
+            if(err.func)
+                std::cerr << "acquire credential: " << err.func << " failed, " << Gss::errorMessage(err.code1, err.code2) << std::endl;
+
+            return -1;
         }
 
-        auto buf = recvMessage();
-        std::cout << "recv data: " << buffer2hexstring(buf.data(), buf.size()) << std::endl;
+        // failures of the connections are formatted on the log thread, off the event loops
+        Gss::ErrorLog::instance().setWriter([](std::string_view line)
+        {
+            const std::scoped_lock guard{ outputLock };
+            std::cerr << line << std::endl;
+        });
+
+        std::vector<std::thread> workers;
 
-        auto res = sendMIC(buf.data(), buf.size());
-        std::cout << "send mic: " << (res ? "success" : "failed") << std::endl;
+        for(size_t it = 0; it < threads; ++it)
+        {
+            workers.emplace_back([this]
+            {
+                try
+                {
+                    worker();
+                }
+                catch(const std::exception & err)
+                {
+                    const std::scoped_lock guard{ outputLock };
+                    std::cerr << "exception: " << err.what() << std::endl;
+                }
+            });
+        }
+
+        for(auto & th : workers)
+            th.join();
 
         return 0;
     }
@@ -121,6 +429,10 @@ int main(int argc, char **argv)
     int res = 0;
     int port = 44444;
     std::string service = "TestService";
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    bool verbose = true;
+    Gss::ChannelBindings bindings;
+    Gss::Mechanism mech = Gss::Mechanism::Default;
 
     for(int it = 1; it < argc; ++it)
     {
@@ -143,15 +455,51 @@ int main(int argc, char **argv)
             it = it + 1;
         }
         else
+        if(0 == std::strcmp(argv[it], "--threads") && it + 1 < argc)
+        {
+            try
+            {
+                threads = std::max(1, std::stoi(argv[it + 1]));
+            }
+            catch(const std::invalid_argument &)
+            {
+                std::cerr << "incorrect threads number" << std::endl;
+            }
+            it = it + 1;
+        }
+        else
+        if(0 == std::strcmp(argv[it], "--quiet"))
+        {
+            verbose = false;
+        }
+        else
+        if(0 == std::strcmp(argv[it], "--channel-binding") && it + 1 < argc)
+        {
+            bindings = Gss::ChannelBindings(argv[it + 1], strlen(argv[it + 1]));
+            it = it + 1;
+        }
+        else
+        if(0 == std::strcmp(argv[it], "--mech") && it + 1 < argc)
+        {
+            if(0 == std::strcmp(argv[it + 1], "krb5"))
+                mech = Gss::Mechanism::Krb5;
+            else
+            if(0 == std::strcmp(argv[it + 1], "spnego"))
+                mech = Gss::Mechanism::Spnego;
+            else
+                std::cerr << "unknown mechanism" << std::endl;
+            it = it + 1;
+        }
+        else
         {
-            std::cout << "usage: " << argv[0] << " --port 44444" << " --service <" << service << ">" << std::endl;
+            std::cout << "usage: " << argv[0] << " --port 44444" << " --service <" << service << ">" << " --threads " << threads << " [--channel-binding data]" << " [--mech krb5|spnego]" << " [--quiet]" << std::endl;
             return 0;
         }
     }
 
     try
     {
-        res = GssApiServer().start(port, service);
+        res = GssApiServer(service, bindings, mech, port, verbose).start(threads);
     }
     catch(const std::exception & err)
     {
@@ -0,0 +1,217 @@
+/***************************************************************************
+ *   Copyright © 2023 by Andrey Afletdinov <public.irkutsk@gmail.com>      *
+ *                                                                         *
+ *   https://github.com/AndreyBarmaley/gssapi-layer-cpp                    *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "gsslayer.h"
+#include "gssloopback.h"
+#include "localkdc.h"
+
+typedef Gss::LoopbackContext<Gss::ClientContext> StressClient;
+typedef Gss::LoopbackContext<Gss::ServiceContext> StressServer;
+
+/// the peer threads may be blocked on the loopback, stop the process on the first failure
+[[noreturn]] void fail(const char* what, size_t round, const Gss::Result & res = Gss::Result())
+{
+    std::cerr << what << " failed, round: " << round;
+
+    if(! res)
+        std::cerr << ", " << res.func() << ": " << res.message();
+
+    std::cerr << std::endl;
+    std::_Exit(EXIT_FAILURE);
+}
+
+std::vector<uint8_t> payload(size_t round)
+{
+    // sizes from 1 byte to 4K, the content names the round
+    std::vector<uint8_t> res(1 + (round * 131) % 4096);
+
+    for(size_t it = 0; it < res.size(); ++it)
+        res[it] = round + it;
+
+    return res;
+}
+
+/// one direction: every round is one message, one MIC and one primitive wrap, in this order
+void writer(Gss::Context & ctx, size_t rounds)
+{
+    Gss::Buffer token;
+
+    for(size_t round = 0; round < rounds; ++round)
+    {
+        auto msg = payload(round);
+
+        if(auto res = ctx.sendMessage(msg.data(), msg.size()); ! res)
+            fail("sendMessage", round, res);
+
+        if(auto res = ctx.sendMIC(msg.data(), msg.size()); ! res)
+            fail("sendMIC", round, res);
+
+        // the one writer keeps the token order between wrap() and sendToken()
+        if(auto res = ctx.wrap(msg.data(), msg.size(), token); ! res)
+            fail("wrap", round, res);
+
+        ctx.sendToken(token.data(), token.size());
+    }
+}
+
+void reader(Gss::Context & ctx, size_t rounds)
+{
+    Gss::Buffer plain;
+    std::vector<uint8_t> buf;
+
+    for(size_t round = 0; round < rounds; ++round)
+    {
+        auto msg = payload(round);
+
+        if(auto res = ctx.recvMessage(buf); ! res)
+            fail("recvMessage", round, res);
+
+        if(buf != msg)
+            fail("recvMessage data", round);
+
+        if(auto res = ctx.recvMIC(msg.data(), msg.size()); ! res)
+            fail("recvMIC", round, res);
+
+        auto token = ctx.recvToken();
+
+        if(auto res = ctx.unwrap(token.data(), token.size(), plain); ! res)
+            fail("unwrap", round, res);
+
+        if(plain.size() != msg.size() || 0 != std::memcmp(plain.data(), msg.data(), msg.size()))
+            fail("unwrap data", round);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string service = "stress@localhost";
+    size_t rounds = 20000;
+    bool kdc = true;
+
+    for(int it = 1; it < argc; ++it)
+    {
+        if(0 == std::strcmp(argv[it], "--rounds") && it + 1 < argc)
+        {
+            rounds = std::stoul(argv[it + 1]);
+            it = it + 1;
+        }
+        else
+        if(0 == std::strcmp(argv[it], "--service") && it + 1 < argc)
+        {
+            service.assign(argv[it + 1]);
+            it = it + 1;
+        }
+        else
+        if(0 == std::strcmp(argv[it], "--no-kdc"))
+        {
+            kdc = false;
+        }
+        else
+        {
+            std::cout << "usage: " << argv[0] << " --rounds " << rounds << " [--service <" << service << ">" << " --no-kdc]" << std::endl;
+            return 0;
+        }
+    }
+
+    LocalKdc local;
+
+    if(kdc && ! local.start(service))
+        return -1;
+
+    auto [cliep, srvep] = Gss::makeLoopback();
+    StressClient cli(std::move(cliep));
+    StressServer srv(std::move(srvep));
+
+    if(auto res = srv.acquireCredential(service, Gss::NameType::NtHostService); ! res)
+    {
+        std::cerr << "acquire credential: " << res.func() << " failed, " << res.message() << std::endl;
+        return -1;
+    }
+
+    try
+    {
+        // blocking handshake over the loopback, the acceptor on its own thread
+        Gss::Result accepted;
+        std::thread acceptor([&]{ accepted = srv.acceptClient(); });
+
+        auto res = cli.initConnect(service, Gss::NameType::NtHostService,
+                        GSS_C_MUTUAL_FLAG | GSS_C_REPLAY_FLAG | GSS_C_SEQUENCE_FLAG | GSS_C_CONF_FLAG | GSS_C_INTEG_FLAG);
+        acceptor.join();
+
+        if(! res || ! accepted)
+        {
+            std::cerr << "handshake failed, " << (res ? accepted : res).message() << std::endl;
+            return -1;
+        }
+
+        cli.setConcurrentMode(true);
+        srv.setConcurrentMode(true);
+
+        // the message functions read the deadline for the handler, a third thread refreshes it meanwhile
+        for(Gss::Context* ctx : { static_cast<Gss::Context*>(& cli), static_cast<Gss::Context*>(& srv) })
+            ctx->setExpiryHandler([](Gss::Context &){ fail("context lifetime", 0); }, std::chrono::seconds(0));
+
+        std::atomic<bool> running{ true };
+        std::thread refresher([&]
+        {
+            for(size_t round = 0; running; ++round)
+            {
+                if(auto res = cli.refreshLifetime(); ! res)
+                    fail("client refreshLifetime", round, res);
+
+                if(auto res = srv.refreshLifetime(); ! res)
+                    fail("service refreshLifetime", round, res);
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+
+        // one reader and one writer thread on each context, both directions at once
+        std::thread threads[] = {
+            std::thread([&]{ writer(cli, rounds); }), std::thread([&]{ reader(cli, rounds); }),
+            std::thread([&]{ writer(srv, rounds); }), std::thread([&]{ reader(srv, rounds); })
+        };
+
+        for(auto & th : threads)
+            th.join();
+
+        running = false;
+        refresher.join();
+    }
+    catch(const std::exception & err)
+    {
+        std::cerr << "exception: " << err.what() << std::endl;
+        return -1;
+    }
+
+    auto & stats = cli.contextStats();
+    std::cout << "rounds: " << rounds << ", client wraps: " << stats.wraps << ", unwraps: " << stats.unwraps <<
+        ", errors: " << stats.sendErrors + stats.recvErrors << std::endl;
+
+    return 0;
+}
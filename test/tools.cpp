@@ -28,6 +28,7 @@
 #include <arpa/inet.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <cstring>
 #include <iostream>
@@ -35,7 +36,7 @@
 
 #include "tools.h"
 
-int TCPSocket::listen(std::string_view ipaddr, uint16_t port, int conn)
+int TCPSocket::listen(std::string_view ipaddr, uint16_t port, int conn, bool reuseport)
 {
     int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);            
     if(0 > fd)
@@ -48,6 +49,10 @@ int TCPSocket::listen(std::string_view ipaddr, uint16_t port, int conn)
         std::cerr << "socket reuseaddr failed, error: " << strerror(errno) << ", code: " << err << std::endl;
     }
 
+    // one listen socket per worker, the kernel balances the connections
+    if(reuseport && 0 > setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, & reuse, sizeof(reuse)))
+        throw std::runtime_error("socket reuseport failed");
+
     struct sockaddr_in sockaddr;
     memset(& sockaddr, 0, sizeof(struct sockaddr_in));
 
@@ -73,6 +78,14 @@ int TCPSocket::accept(int fd)
     return sock;
 }
 
+void TCPSocket::setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if(0 > flags || 0 > fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+        throw std::runtime_error("socket nonblock");
+}
+
 int TCPSocket::connect(std::string_view ipaddr, uint16_t port)
 {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -93,43 +106,3 @@ int TCPSocket::connect(std::string_view ipaddr, uint16_t port)
 
     return sock;
 }
-
-uint32_t TCPSocket::readIntBE32(int fd)
-{
-    // read int be32
-    uint32_t buf;
-    auto len = read(fd, & buf, 4);
-
-    if(len != 4)
-        throw std::runtime_error("socket read");
-
-    return ntohl(buf);
-}
-
-void TCPSocket::writeIntBE32(int fd, uint32_t val)
-{
-    uint32_t buf = htonl(val);
-    auto len = write(fd, & buf, 4);
-
-    if(len != 4)
-        throw std::runtime_error("socket write");
-}
-
-std::vector<uint8_t> TCPSocket::readData(int fd, size_t sz)
-{
-    std::vector<uint8_t> buf(sz, 0);
-    auto len = read(fd, buf.data(), buf.size());
-
-    if(len != buf.size())
-        throw std::runtime_error("socket read");
-
-    return buf;
-}
-
-void TCPSocket::writeData(int fd, const void* buf, size_t sz)
-{
-    auto len = write(fd, buf, sz);
-
-    if(len != sz)
-        throw std::runtime_error("socket write");
-}
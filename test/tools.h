@@ -27,15 +27,10 @@
 
 namespace TCPSocket
 {
-    int listen(std::string_view ipaddr, uint16_t port, int conn = 5);
+    int listen(std::string_view ipaddr, uint16_t port, int conn = 5, bool reuseport = false);
     int accept(int fd);
+    void setNonBlocking(int fd);
     int connect(std::string_view ipaddr, uint16_t port);
-
-    uint32_t readIntBE32(int fd);
-    void writeIntBE32(int fd, uint32_t);
-
-    std::vector<uint8_t> readData(int fd, size_t);
-    void writeData(int fd, const void*, size_t);
 }
 
 #endif